@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/*
+ * chatbench is a load generator for the chat server. It opens many clients
+ * at once, logs every one in and makes it join a group, then every client
+ * runs commands back to back: a command is sent, and the next one follows
+ * once the prompt is back. The latency of a command is the time from
+ * sending it to seeing the prompt.
+ *
+ *   chatbench [-h host] [-p port] [-c clients] [-d seconds] [-g group size]
+ *             [-n name prefix] [-m mix]
+ *
+ * mix weighs the commands, e.g. "tell=40,yell=5,gyell=5,listMail=25,who=25".
+ * A yell reaches every user, so yells grow the traffic with the square of
+ * the clients.
+ */
+#ifndef SSC_SERVER_IP
+#define SSC_SERVER_IP "172.22.46.36" /* the default of server.c */
+#endif
+#define BENCH_HOST SSC_SERVER_IP
+#define BENCH_PORT 4321 /* SSC_SERVER_PORT */
+#define BENCH_CLIENTS 1000
+#define BENCH_SECONDS 10
+#define BENCH_GROUP 10
+#define BENCH_PREFIX "bench"
+#define BENCH_PASSWD "bench"
+#define BENCH_MIX "tell=40,yell=5,gyell=5,listMail=25,who=25"
+#define BENCH_MSG "bench load"
+
+#define BENCH_NAME_LEN 32
+#define BENCH_EXPECT_LEN 48
+
+enum { B_TELL, B_YELL, B_GYELL, B_LISTMAIL, B_WHO, B_OPS };
+static const char *op_names[B_OPS] = {"tell", "yell", "gyell", "listMail",
+                                      "who"};
+
+/*
+ * The states of a client, every state but B_CONNECTING and B_RUNNING waits
+ * for the text in expect.
+ */
+enum {
+    B_CONNECTING,
+    B_NAME,
+    B_PASSWD,
+    B_LOGIN,
+    B_CREATE,
+    B_JOIN,
+    B_RUNNING,
+    B_DONE,
+};
+
+typedef struct __bench_client {
+    int fd, id, state, op;
+    char name[BENCH_NAME_LEN];
+    char group[BENCH_NAME_LEN];
+    char expect[BENCH_EXPECT_LEN];
+    size_t expect_len;
+    /* the end of the last read, an expected text may span two reads */
+    char tail[BENCH_EXPECT_LEN];
+    size_t tail_len;
+    uint64_t sent_at;
+} bench_client;
+
+/*
+ * samples keeps the latencies of one command in nanoseconds.
+ */
+typedef struct __samples {
+    uint64_t *ns;
+    size_t len, cap;
+} samples;
+
+static struct {
+    const char *host;
+    int port, clients, seconds, group;
+    const char *prefix;
+    int weight[B_OPS], total_weight;
+} opt;
+
+static bench_client *clients;
+static samples stats[B_OPS];
+static int epfd, logged_in, failed;
+static uint64_t run_start, run_end;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void add_sample(samples *s, uint64_t ns) {
+    if (s->len == s->cap) {
+        size_t cap = (s->cap) ? s->cap * 2 : 4096;
+        uint64_t *ns_list = realloc(s->ns, cap * sizeof(uint64_t));
+        exit_if_fail(ns_list == NULL, 1, "realloc() error");
+        s->ns = ns_list;
+        s->cap = cap;
+    }
+    s->ns[s->len++] = ns;
+}
+
+static int parse_mix(const char *mix) {
+    char *dup = strdup(mix), *save = NULL;
+    memset(opt.weight, 0, sizeof(opt.weight));
+    opt.total_weight = 0;
+    for (char *tok = strtok_r(dup, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        if (eq) *eq = '\0';
+        int op = 0;
+        while (op < B_OPS && strcmp(op_names[op], tok) != 0) op++;
+        if (op == B_OPS || eq == NULL || atoi(eq + 1) < 0) {
+            fprintf(stderr, "bad mix: %s\n", mix);
+            free(dup);
+            return -1;
+        }
+        opt.weight[op] = atoi(eq + 1);
+        opt.total_weight += opt.weight[op];
+    }
+    free(dup);
+    return (opt.total_weight > 0) ? 0 : -1;
+}
+
+static void expect(bench_client *c, const char *text) {
+    snprintf(c->expect, sizeof(c->expect), "%s", text);
+    c->expect_len = strlen(c->expect);
+    c->tail_len = 0;
+}
+
+static void expect_prompt(bench_client *c) {
+    char prompt[BENCH_EXPECT_LEN];
+    snprintf(prompt, sizeof(prompt), "%s> ", c->name);
+    expect(c, prompt);
+}
+
+/*
+ * found() looks for the expected text in what was just read, it keeps the
+ * end of data in case the text is cut by the next read.
+ */
+static int found(bench_client *c, const char *data, size_t len) {
+    size_t keep = c->expect_len - 1;
+    if (c->tail_len) {
+        char joint[2 * BENCH_EXPECT_LEN];
+        size_t head = (len < keep) ? len : keep;
+        memcpy(joint, c->tail, c->tail_len);
+        memcpy(joint + c->tail_len, data, head);
+        if (memmem(joint, c->tail_len + head, c->expect, c->expect_len)) {
+            return 1;
+        }
+    }
+    if (memmem(data, len, c->expect, c->expect_len)) return 1;
+
+    if (len >= keep) {
+        memcpy(c->tail, data + len - keep, keep);
+        c->tail_len = keep;
+    } else {
+        size_t drop = (c->tail_len + len > keep) ? c->tail_len + len - keep
+                                                 : 0;
+        memmove(c->tail, c->tail + drop, c->tail_len - drop);
+        memcpy(c->tail + c->tail_len - drop, data, len);
+        c->tail_len += len - drop;
+    }
+    return 0;
+}
+
+static void close_client(bench_client *c) {
+    if (c->state == B_DONE) return;
+    c->state = B_DONE;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+}
+
+static void fail_client(bench_client *c, const char *why) {
+    if (c->state == B_DONE) return;
+    fprintf(stderr, "%s: %s\n", c->name, why);
+    failed++;
+    close_client(c);
+}
+
+static void send_line(bench_client *c, const char *fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    /* a line is far smaller than the socket buffer */
+    if (write(c->fd, line, len) != len) fail_client(c, "write() error");
+}
+
+static void next_command(bench_client *c) {
+    uint64_t now = now_ns();
+    if (now >= run_end) {
+        close_client(c);
+        return;
+    }
+
+    int pick = rand() % opt.total_weight, op = 0;
+    while (pick >= opt.weight[op]) pick -= opt.weight[op++];
+    c->op = op;
+    c->sent_at = now;
+    expect_prompt(c);
+
+    switch (op) {
+        case B_TELL:
+            send_line(c, "tell %s%d " BENCH_MSG "\n", opt.prefix,
+                      rand() % opt.clients);
+            break;
+        case B_YELL:
+            send_line(c, "yell " BENCH_MSG "\n");
+            break;
+        case B_GYELL:
+            send_line(c, "gyell %s " BENCH_MSG "\n", c->group);
+            break;
+        case B_LISTMAIL:
+            send_line(c, "listMail\n");
+            break;
+        case B_WHO:
+            send_line(c, "who\n");
+            break;
+    }
+}
+
+/*
+ * step() moves c to its next state once the expected text has arrived.
+ */
+static void step(bench_client *c) {
+    switch (c->state) {
+        case B_NAME:
+            c->state = B_PASSWD;
+            expect(c, "Password: ");
+            send_line(c, "%s\n", c->name);
+            break;
+        case B_PASSWD:
+            c->state = B_LOGIN;
+            expect_prompt(c);
+            send_line(c, BENCH_PASSWD "\n");
+            break;
+        case B_LOGIN:
+            /* the group exists already unless c is its first member */
+            c->state = B_CREATE;
+            expect_prompt(c);
+            send_line(c, "createGroup %s\n", c->group);
+            break;
+        case B_CREATE:
+            c->state = B_JOIN;
+            expect_prompt(c);
+            send_line(c, "addGroup %s\n", c->group);
+            break;
+        case B_JOIN:
+            c->state = B_RUNNING;
+            logged_in++;
+            break;
+        case B_RUNNING:
+            add_sample(&stats[c->op], now_ns() - c->sent_at);
+            next_command(c);
+            break;
+    }
+}
+
+static void client_event(bench_client *c, uint32_t events) {
+    if (c->state == B_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            fail_client(c, strerror(err));
+            return;
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->state = B_NAME;
+        expect(c, "Who're you: ");
+        return;
+    }
+
+    char buf[16 * 1024];
+    while (c->state != B_DONE) {
+        ssize_t len = read(c->fd, buf, sizeof(buf));
+        if (len == -1 && errno == EINTR) continue;
+        if (len == -1 && errno == EAGAIN) break;
+        if (len <= 0) {
+            fail_client(c, (len == 0) ? "closed by server" : strerror(errno));
+            break;
+        }
+        /* a ready client expects nothing until the run starts */
+        if (c->state == B_RUNNING && run_start == 0) continue;
+        if (found(c, buf, len)) step(c);
+    }
+}
+
+static void connect_client(bench_client *c, struct sockaddr_in *addr) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    exit_if_fail(c->fd, -1, "socket() error");
+    if (connect(c->fd, (struct sockaddr *)addr, sizeof(*addr)) == -1 &&
+        errno != EINPROGRESS) {
+        perror("connect() error");
+        exit(EXIT_FAILURE);
+    }
+    c->state = B_CONNECTING;
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    exit_if_fail(epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev), -1,
+                 "epoll_ctl() error");
+}
+
+static void run_loop(uint64_t until, int (*done)()) {
+    struct epoll_event events[256];
+    while (!done() && now_ns() < until) {
+        int n = epoll_wait(epfd, events, 256, 100);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait() error");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            client_event(events[i].data.ptr, events[i].events);
+        }
+    }
+}
+
+static int all_logged_in() { return logged_in + failed == opt.clients; }
+static int all_done() {
+    for (int i = 0; i < opt.clients; i++) {
+        if (clients[i].state != B_DONE) return 0;
+    }
+    return 1;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(samples *s, double p) {
+    if (s->len == 0) return 0;
+    size_t i = (size_t)(p * (s->len - 1) + 0.5);
+    return s->ns[i] / 1000.0;
+}
+
+static void report_line(const char *name, samples *s, double seconds) {
+    qsort(s->ns, s->len, sizeof(uint64_t), cmp_u64);
+    printf("%-10s %10zu %12.1f %10.1f %10.1f %10.1f %10.1f\n", name, s->len,
+           s->len / seconds, percentile_us(s, 0.5), percentile_us(s, 0.99),
+           percentile_us(s, 0.999),
+           (s->len) ? s->ns[s->len - 1] / 1000.0 : 0.0);
+}
+
+static void report(double seconds) {
+    samples all = {0};
+    printf("%-10s %10s %12s %10s %10s %10s %10s\n", "command", "count",
+           "ops/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int op = 0; op < B_OPS; op++) {
+        if (stats[op].len == 0) continue;
+        for (size_t i = 0; i < stats[op].len; i++) {
+            add_sample(&all, stats[op].ns[i]);
+        }
+        report_line(op_names[op], &stats[op], seconds);
+    }
+    report_line("total", &all, seconds);
+    free(all.ns);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-h host] [-p port] [-c clients] [-d seconds] "
+            "[-g group size] [-n name prefix] [-m mix]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    opt.host = BENCH_HOST;
+    opt.port = BENCH_PORT;
+    opt.clients = BENCH_CLIENTS;
+    opt.seconds = BENCH_SECONDS;
+    opt.group = BENCH_GROUP;
+    opt.prefix = BENCH_PREFIX;
+    const char *mix = BENCH_MIX;
+
+    int c;
+    while ((c = getopt(argc, argv, "h:p:c:d:g:n:m:")) != -1) {
+        switch (c) {
+            case 'h':
+                opt.host = optarg;
+                break;
+            case 'p':
+                opt.port = atoi(optarg);
+                break;
+            case 'c':
+                opt.clients = atoi(optarg);
+                break;
+            case 'd':
+                opt.seconds = atoi(optarg);
+                break;
+            case 'g':
+                opt.group = atoi(optarg);
+                break;
+            case 'n':
+                opt.prefix = optarg;
+                break;
+            case 'm':
+                mix = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (opt.clients < 1 || opt.seconds < 1 || opt.group < 1) usage(argv[0]);
+    if (parse_mix(mix) == -1) usage(argv[0]);
+
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(opt.port)};
+    if (inet_pton(AF_INET, opt.host, &addr.sin_addr) != 1) {
+        struct hostent *host = gethostbyname(opt.host);
+        if (host == NULL) usage(argv[0]);
+        memcpy(&addr.sin_addr, host->h_addr_list[0], sizeof(addr.sin_addr));
+    }
+
+    /* a client is a socket */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    srand(getpid());
+    exit_if_fail(epfd = epoll_create1(0), -1, "epoll_create1() error");
+    clients = calloc(opt.clients, sizeof(bench_client));
+    exit_if_fail(clients == NULL, 1, "calloc() error");
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < opt.clients; i++) {
+        bench_client *cl = &clients[i];
+        cl->id = i;
+        snprintf(cl->name, sizeof(cl->name), "%s%d", opt.prefix, i);
+        snprintf(cl->group, sizeof(cl->group), "%s.g%d", opt.prefix,
+                 i / opt.group);
+        connect_client(cl, &addr);
+    }
+
+    /* log in, the run starts once every client is ready */
+    run_loop(start + 60 * 1000000000ull, all_logged_in);
+    printf("%d clients logged in in %.2fs, %d failed\n", logged_in,
+           (now_ns() - start) / 1e9, failed);
+    if (logged_in == 0) return EXIT_FAILURE;
+
+    run_start = now_ns();
+    run_end = run_start + opt.seconds * 1000000000ull;
+    for (int i = 0; i < opt.clients; i++) {
+        if (clients[i].state == B_RUNNING) next_command(&clients[i]);
+    }
+    run_loop(run_end + 10 * 1000000000ull, all_done);
+
+    double seconds = (now_ns() - run_start) / 1e9;
+    printf("%d clients, %.2fs, mix %s\n", logged_in, seconds, mix);
+    report(seconds);
+    return (failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -9,3 +9,6 @@
 
 #define chatroom_user_name_length (1024-1)
 #define client_intput_length (1024-1)
+
+#define SSC_OUTQ_HIGH_WATER (64 * 1024)
+#define SSC_OUTQ_HARD_LIMIT (1024 * 1024)
@@ -0,0 +1,86 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+static size_t arena_round(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    size = arena_round(size);
+    arena_chunk *chunk = a->head;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t cap = (size > SSC_ARENA_CHUNK) ? size : SSC_ARENA_CHUNK;
+        if ((chunk = malloc(sizeof(arena_chunk) + cap)) == NULL) return NULL;
+        chunk->size = cap;
+        chunk->used = 0;
+        chunk->next = a->head;
+        a->head = chunk;
+    }
+
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+char *arena_strndup(arena *a, const char *s, size_t n) {
+    char *p = arena_alloc(a, n + 1);
+    if (p == NULL) return NULL;
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+char *arena_strdup(arena *a, const char *s) {
+    return arena_strndup(a, s, strlen(s));
+}
+
+/*
+ * arena_reset() keeps the chunk allocated first, the others only served an
+ * unusually large line.
+ */
+void arena_reset(arena *a) {
+    arena_chunk *chunk = a->head;
+    while (chunk && chunk->next) {
+        arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    if (chunk) chunk->used = 0;
+    a->head = chunk;
+}
+
+void arena_free(arena *a) {
+    arena_reset(a);
+    free(a->head);
+    a->head = NULL;
+}
+
+/*
+ * The free list is threaded through the first bytes of the free objects.
+ */
+void *slab_alloc(slab *s) {
+    if (s->free_list == NULL) {
+        size_t size = arena_round((s->size > sizeof(void *)) ? s->size
+                                                             : sizeof(void *));
+        char *block = malloc(size * SSC_SLAB_BLOCK);
+        if (block == NULL) return NULL;
+        for (int i = SSC_SLAB_BLOCK - 1; i >= 0; i--) {
+            slab_free(s, block + i * size);
+        }
+    }
+
+    void *obj = s->free_list;
+    s->free_list = *(void **)obj;
+    return obj;
+}
+
+void slab_free(slab *s, void *obj) {
+    if (obj == NULL) return;
+    *(void **)obj = s->free_list;
+    s->free_list = obj;
+}
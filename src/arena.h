@@ -0,0 +1,51 @@
+#include <stddef.h>
+
+#ifndef SIMPLE_SERVER_ARENA_H
+#define SIMPLE_SERVER_ARENA_H
+
+/*
+ * arena is a bump allocator for what lives as long as one input line.
+ * Nothing is freed on its own, arena_reset() releases everything at once
+ * and keeps the first chunk, so an arena reused line after line stops
+ * touching the heap once its chunk fits a line.
+ */
+#ifndef SSC_ARENA_CHUNK
+#define SSC_ARENA_CHUNK (8 * 1024)
+#endif
+
+typedef struct __arena_chunk {
+    struct __arena_chunk *next;
+    size_t size, used;
+    char data[];
+} arena_chunk;
+
+typedef struct __arena {
+    arena_chunk *head;
+} arena;
+
+void *arena_alloc(arena *a, size_t size);
+char *arena_strndup(arena *a, const char *s, size_t n);
+char *arena_strdup(arena *a, const char *s);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+/*
+ * slab is a pool of objects of one size, carved from blocks of
+ * SSC_SLAB_BLOCK objects. A freed object goes back to the pool and blocks
+ * are never returned to the heap. A slab belongs to one thread.
+ */
+#ifndef SSC_SLAB_BLOCK
+#define SSC_SLAB_BLOCK 64
+#endif
+
+typedef struct __slab {
+    size_t size;
+    void *free_list;
+} slab;
+
+#define SLAB_INIT(type) {.size = sizeof(type), .free_list = NULL}
+
+void *slab_alloc(slab *s);
+void slab_free(slab *s, void *obj);
+
+#endif /* SIMPLE_SERVER_ARENA_H */
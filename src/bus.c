@@ -0,0 +1,110 @@
+#include "bus.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db.h"
+
+#define BUS_NODE_LEN 16 /* hex digits of the node id */
+
+/*
+ * A payload is the id of the publishing node followed by the line.
+ */
+static char bus_node_id[BUS_NODE_LEN + 1];
+static int bus_is_remote = 0;
+static int bus_is_ready = 0; /* the subscription of the node is active */
+static __thread bus_cb bus_handler = NULL;
+
+static const char *bus_kind_name(int kind) {
+    switch (kind) {
+        case SSC_BUS_YELL:
+            return "yell";
+        case SSC_BUS_USER:
+            return "user.";
+        case SSC_BUS_GROUP:
+            return "group.";
+        case SSC_BUS_CACHE:
+            return "cache.";
+    }
+    return NULL;
+}
+
+/*
+ * bus_open() is called once before the workers start, remote tells
+ * whether other nodes may share the chatroom.
+ */
+int bus_open(int remote) {
+    unsigned long long id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+        id = ((unsigned long long)time(NULL) << 32) ^ getpid();
+    }
+    snprintf(bus_node_id, sizeof(bus_node_id), "%016llx", id);
+    bus_is_remote = remote;
+    return 0;
+}
+
+int bus_remote() { return bus_is_remote; }
+
+/*
+ * bus_node() is the id of the node, a new one every time the server starts.
+ */
+const char *bus_node() { return bus_node_id; }
+
+static void bus_message(const char *channel, const char *message) {
+    if (channel == NULL) {
+        __atomic_store_n(&bus_is_ready, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    if (bus_handler == NULL || strlen(message) < BUS_NODE_LEN) return;
+    int own = strncmp(message, bus_node_id, BUS_NODE_LEN) == 0;
+
+    const char *line = message + BUS_NODE_LEN;
+    const char *name = channel + strlen(SSC_BUS_PREFIX);
+    for (int kind = SSC_BUS_YELL; kind <= SSC_BUS_CACHE; kind++) {
+        const char *prefix = bus_kind_name(kind);
+        size_t len = strlen(prefix);
+        if (strncmp(name, prefix, len) != 0) continue;
+        if (own && kind != SSC_BUS_CACHE) return;
+
+        if (kind == SSC_BUS_YELL) {
+            if (name[len] == '\0') bus_handler(kind, NULL, line);
+        } else if (name[len] != '\0') {
+            bus_handler(kind, name + len, line);
+        }
+        return;
+    }
+}
+
+/*
+ * bus_subscribe() makes the calling worker the subscriber of the node,
+ * cb(kind, target, line) is called for the lines of the other nodes.
+ */
+int bus_subscribe(bus_cb cb) {
+    if (!bus_is_remote) return 0;
+    bus_handler = cb;
+    return db_subscribe(SSC_BUS_PREFIX "*", bus_message);
+}
+
+/*
+ * bus_ready() tells whether the node receives what the other nodes publish,
+ * a local bus is always ready.
+ */
+int bus_ready() {
+    return !bus_is_remote || __atomic_load_n(&bus_is_ready, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * bus_publish() sends line to the other nodes without waiting for redis.
+ */
+int bus_publish(int kind, const char *target, const char *line) {
+    if (!bus_is_remote) return 0;
+
+    const char *name = bus_kind_name(kind);
+    if (name == NULL) return -1;
+    db_send("PUBLISH " SSC_BUS_PREFIX "%s%s %s%s", name,
+            (target) ? target : "", bus_node_id, line);
+    return 0;
+}
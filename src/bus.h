@@ -0,0 +1,36 @@
+#ifndef SIMPLE_SERVER_BUS_H
+#define SIMPLE_SERVER_BUS_H
+
+/*
+ * The bus carries chatroom lines between the nodes (server processes) of a
+ * chatroom sharing a redis store. A line is published to one channel:
+ *   Chatroom.bus.yell            for everybody
+ *   Chatroom.bus.user.<name>     for a user
+ *   Chatroom.bus.group.<group>   for the members of a group
+ *   Chatroom.bus.cache.<key>     the key of the store was written
+ * Every node holds a single subscription to Chatroom.bus.*, made by its
+ * first worker, and hands what it receives to its own users. A node skips
+ * the lines it published itself, it served its own users directly, but not
+ * the writes of a key: they are handed to every worker of every node.
+ *
+ * Without redis the chatroom is a single node, the bus is a local stand-in
+ * which has nobody to deliver to.
+ */
+#define SSC_BUS_PREFIX "Chatroom.bus."
+
+#define SSC_BUS_YELL 1
+#define SSC_BUS_USER 2
+#define SSC_BUS_GROUP 3
+#define SSC_BUS_CACHE 4 /* the line is empty */
+
+/* target is the user, the group or the key, NULL for SSC_BUS_YELL */
+typedef void (*bus_cb)(int kind, const char *target, const char *line);
+
+int bus_open(int remote);
+int bus_remote();
+const char *bus_node();
+int bus_subscribe(bus_cb cb);
+int bus_ready();
+int bus_publish(int kind, const char *target, const char *line);
+
+#endif /* SIMPLE_SERVER_BUS_H */
@@ -0,0 +1,173 @@
+#include "cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bus.h"
+#include "hashmap.h"
+
+/*
+ * user and group are 1, 0 or SSC_CACHE_UNKNOWN. members is owned by the
+ * entry and is valid until the calling job yields.
+ */
+typedef struct __cache_entry {
+    int user, group;
+    char *passwd;
+    str_list *members;
+    char key[];
+} cache_entry;
+
+static __thread hashmap cache_map;
+static __thread unsigned long cache_gen = 0;
+static __thread int cache_forked = 0;
+
+/*
+ * The cache is bypassed until the node receives the bus, it would miss the
+ * writes of the other nodes. A forked console isn't told of any write, it
+ * bypasses the cache as well.
+ */
+static int cache_ready() { return !cache_forked && bus_ready(); }
+
+static void cache_free_entry(cache_entry *e) {
+    free(e->passwd);
+    free(e->members);
+    free(e);
+}
+
+static cache_entry *cache_get(const char *key) {
+    if (!cache_ready() || key == NULL) return NULL;
+    return hashmap_get(&cache_map, key);
+}
+
+/*
+ * cache_entry_of() returns the entry of key to store into, or NULL if the
+ * value read at epoch may be stale.
+ */
+static cache_entry *cache_entry_of(const char *key, unsigned long epoch) {
+    if (!cache_ready() || key == NULL || epoch != cache_gen) return NULL;
+
+    cache_entry *e = hashmap_get(&cache_map, key);
+    if (e) return e;
+
+    if (cache_map.len >= SSC_CACHE_MAX_KEYS) cache_forget_all();
+
+    size_t len = strlen(key);
+    if ((e = calloc(1, sizeof(cache_entry) + len + 1)) == NULL) return NULL;
+    e->user = e->group = SSC_CACHE_UNKNOWN;
+    memcpy(e->key, key, len + 1);
+    if (hashmap_put(&cache_map, e->key, e) == -1) {
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+unsigned long cache_epoch() { return cache_gen; }
+
+int cache_user(const char *name) {
+    cache_entry *e = cache_get(name);
+    return (e) ? e->user : SSC_CACHE_UNKNOWN;
+}
+
+void cache_set_user(const char *name, int exist, unsigned long epoch) {
+    cache_entry *e = cache_entry_of(name, epoch);
+    if (e) e->user = exist;
+}
+
+int cache_group(const char *group) {
+    cache_entry *e = cache_get(group);
+    return (e) ? e->group : SSC_CACHE_UNKNOWN;
+}
+
+void cache_set_group(const char *group, int exist, unsigned long epoch) {
+    cache_entry *e = cache_entry_of(group, epoch);
+    if (e) e->group = exist;
+}
+
+const char *cache_passwd(const char *name) {
+    cache_entry *e = cache_get(name);
+    return (e) ? e->passwd : NULL;
+}
+
+void cache_set_passwd(const char *name, const char *passwd,
+                      unsigned long epoch) {
+    cache_entry *e = cache_entry_of(name, epoch);
+    if (e == NULL) return;
+    free(e->passwd);
+    e->passwd = strdup(passwd);
+}
+
+str_list *cache_members(const char *group) {
+    cache_entry *e = cache_get(group);
+    return (e) ? e->members : NULL;
+}
+
+/*
+ * cache_set_members() keeps members, the caller still owns members if it
+ * isn't kept, i.e. cache_members() doesn't return it.
+ */
+void cache_set_members(const char *group, str_list *members,
+                       unsigned long epoch) {
+    cache_entry *e = cache_entry_of(group, epoch);
+    if (e == NULL) return;
+    free(e->members);
+    e->members = members;
+}
+
+/*
+ * cache_forget() drops what is cached about the redis key. Chatroom and
+ * Chatroom.group are sets of names, their change forgets the flag of every
+ * name.
+ */
+void cache_forget(const char *key) {
+    cache_gen++;
+
+    int user = strcmp(key, "Chatroom") == 0;
+    int group = strcmp(key, "Chatroom.group") == 0;
+    if (user || group) {
+        size_t iter = 0;
+        for (hashmap_entry *he; (he = hashmap_next(&cache_map, &iter));) {
+            cache_entry *e = he->value;
+            if (user) e->user = SSC_CACHE_UNKNOWN;
+            if (group) e->group = SSC_CACHE_UNKNOWN;
+        }
+        return;
+    }
+
+    cache_entry *e = hashmap_get(&cache_map, key);
+    if (e == NULL) return;
+    free(e->passwd);
+    e->passwd = NULL;
+    free(e->members);
+    e->members = NULL;
+}
+
+void cache_forget_all() {
+    cache_gen++;
+
+    size_t iter = 0;
+    for (hashmap_entry *he; (he = hashmap_next(&cache_map, &iter));) {
+        cache_free_entry(he->value);
+    }
+    hashmap_free(&cache_map);
+}
+
+/*
+ * cache_changed() is called by the worker which wrote key to redis, after
+ * the write. The worker forgets key at once, every worker of every node
+ * forgets it when the bus hands the change over (see store.h forget).
+ */
+void cache_changed(const char *key) {
+    cache_forget(key);
+    bus_publish(SSC_BUS_CACHE, key, "");
+}
+
+static void cache_after_fork() { cache_forked = 1; }
+
+static void cache_atfork() { pthread_atfork(NULL, NULL, cache_after_fork); }
+
+void cache_init() {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, cache_atfork);
+}
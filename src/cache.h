@@ -0,0 +1,42 @@
+#include "store.h"
+
+#ifndef SIMPLE_SERVER_CACHE_H
+#define SIMPLE_SERVER_CACHE_H
+
+/*
+ * cache keeps what the worker read from redis about a name: whether it is
+ * a user (member of Chatroom), whether it is a group (member of
+ * Chatroom.group), the password stored at the key, and the members of the
+ * group. It backs the redis store. The worker writing a key calls
+ * cache_changed(), which drops the entry of every worker of every node
+ * through the bus. A write made outside the chatroom (e.g. redis-cli) isn't
+ * seen until the entry is evicted.
+ *
+ * A lookup which misses takes cache_epoch() before reading redis and hands
+ * it to cache_set_*(), so a value read while the key changed isn't kept.
+ */
+#define SSC_CACHE_UNKNOWN -1
+
+#ifndef SSC_CACHE_MAX_KEYS
+#define SSC_CACHE_MAX_KEYS 65536
+#endif
+
+void cache_init();
+unsigned long cache_epoch();
+
+int cache_user(const char *name);
+void cache_set_user(const char *name, int exist, unsigned long epoch);
+int cache_group(const char *group);
+void cache_set_group(const char *group, int exist, unsigned long epoch);
+const char *cache_passwd(const char *name);
+void cache_set_passwd(const char *name, const char *passwd,
+                      unsigned long epoch);
+str_list *cache_members(const char *group);
+void cache_set_members(const char *group, str_list *members,
+                       unsigned long epoch);
+
+void cache_changed(const char *key);
+void cache_forget(const char *key);
+void cache_forget_all();
+
+#endif /* SIMPLE_SERVER_CACHE_H */
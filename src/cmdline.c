@@ -0,0 +1,148 @@
+#include "cmdline.h"
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static char pipe_name[] = "|";
+
+static inline int printable(char c) { return c > 31 && c < 127; }
+
+/*
+ * plain_span() is the length of the run of printable characters at s which
+ * aren't a space, '|' or a quote.
+ *
+ * With SSE2 16 bytes are classified at once. The loads are aligned, so they
+ * never cross a page even when they read past the end of the line.
+ */
+#ifdef __SSE2__
+__attribute__((no_sanitize_address)) static size_t plain_span(const char *s) {
+    const __m128i low = _mm_set1_epi8(' '), del = _mm_set1_epi8(127);
+    const __m128i bar = _mm_set1_epi8('|');
+    const __m128i dq = _mm_set1_epi8('"'), sq = _mm_set1_epi8('\'');
+
+    uintptr_t off = (uintptr_t)s & 15;
+    const char *p = s - off;
+    unsigned skip = ~0u << off;
+    for (;; p += 16, skip = ~0u) {
+        __m128i v = _mm_load_si128((const __m128i *)p);
+        /* bytes above 126 are negative, so they fail the first compare */
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, low),
+                                   _mm_cmplt_epi8(v, del));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, bar),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, dq),
+                                                    _mm_cmpeq_epi8(v, sq)));
+        unsigned stop = (_mm_movemask_epi8(ok) ^ 0xffff) |
+                        _mm_movemask_epi8(special);
+        stop &= skip;
+        if (stop) return p + __builtin_ctz(stop) - s;
+    }
+}
+#else
+static size_t plain_span(const char *s) {
+    size_t n = 0;
+    for (char c; (c = s[n]) > ' ' && c < 127; n++) {
+        if (c == '|' || c == '"' || c == '\'') break;
+    }
+    return n;
+}
+#endif
+
+/*
+ * copy_text() moves the text at r to *w until a '|', the end of the line or,
+ * for a word, a space. It returns where it stopped in the line. A parameter
+ * is copied a word at a time, so a quote opening any of its words counts.
+ */
+static char *copy_text(char **w, char *r, int word) {
+    int start = 1;
+    for (;;) {
+        size_t n = plain_span(r);
+        if (n) {
+            memmove(*w, r, n);
+            *w += n;
+            r += n;
+            start = 0;
+        }
+
+        char c = *r;
+        if (c == ' ' && !word) {
+            *(*w)++ = c;
+            r++;
+            start = 1;
+            continue;
+        }
+        if (c != '"' && c != '\'') return r;
+
+        char *end = NULL;
+        if (start) {
+            for (end = r + 1; *end != c && printable(*end); end++)
+                ;
+            if (*end != c) end = NULL;
+        }
+        if (end == NULL) {
+            /* an ordinary quote */
+            *(*w)++ = c;
+            r++;
+        } else {
+            memmove(*w, r + 1, end - r - 1);
+            *w += end - r - 1;
+            r = end + 1;
+        }
+        start = 0;
+    }
+}
+
+static cmd_stage *add_stage(cmd_line *cl, char *name) {
+    if (cl->len == SSC_MAX_STAGES) {
+        cl->error = "too many commands in the pipeline";
+        return NULL;
+    }
+    cmd_stage *stage = &cl->stages[cl->len++];
+    stage->name = name;
+    stage->param = NULL;
+    return stage;
+}
+
+/*
+ * cmdline_parse() returns the number of stages in cl, -1 on error. The text
+ * is only moved backwards, a terminator is written after the character
+ * which ended a token has been looked at.
+ */
+int cmdline_parse(char *line, cmd_line *cl) {
+    char *r = line, *w = line;
+    cl->len = 0;
+    cl->error = NULL;
+
+    for (;;) {
+        while (*r == ' ') r++;
+        if (!printable(*r)) break;
+        if (*r == '|') {
+            if (add_stage(cl, pipe_name) == NULL) return -1;
+            r++;
+            continue;
+        }
+
+        cmd_stage *stage = add_stage(cl, w);
+        if (stage == NULL) return -1;
+        r = copy_text(&w, r, 1);
+        char end = *r;
+        *w++ = '\0';
+        if (end == ' ') {
+            while (*++r == ' ')
+                ;
+            char *param = w;
+            r = copy_text(&w, r, 0);
+            end = *r;
+            while (w > param && w[-1] == ' ') w--;
+            if (w > param) stage->param = param;
+            *w++ = '\0';
+        }
+        /* the '|' may be overwritten by now, it's taken from end */
+        if (end != '|') break;
+        if (add_stage(cl, pipe_name) == NULL) return -1;
+        r++;
+    }
+    return cl->len;
+}
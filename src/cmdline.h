@@ -0,0 +1,34 @@
+#include <stddef.h>
+
+#ifndef SIMPLE_SERVER_CMDLINE_H
+#define SIMPLE_SERVER_CMDLINE_H
+
+/*
+ * cmdline_parse() splits a command line into the stages of a pipeline in a
+ * single pass. The line is rewritten in place: names and parameters are
+ * NUL-terminated and quotes are removed, so the stages point into the line
+ * and nothing is allocated.
+ *
+ * The line ends at the first character which isn't printable. A '|' is a
+ * stage of its own named "|", like the console always did. A quote opening
+ * a word keeps spaces and '|' in it until the matching quote, an unmatched
+ * quote is an ordinary character.
+ */
+#ifndef SSC_MAX_STAGES
+#define SSC_MAX_STAGES 32
+#endif
+
+typedef struct __cmd_stage {
+    char *name;
+    char *param; /* NULL if the stage has no parameter */
+} cmd_stage;
+
+typedef struct __cmd_line {
+    int len;
+    const char *error; /* why cmdline_parse() returned -1 */
+    cmd_stage stages[SSC_MAX_STAGES];
+} cmd_line;
+
+int cmdline_parse(char *line, cmd_line *cl);
+
+#endif /* SIMPLE_SERVER_CMDLINE_H */
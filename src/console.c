@@ -1,6 +1,11 @@
+#define _GNU_SOURCE
 #include "console.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -11,6 +16,9 @@
 #include <unistd.h>
 #include <wait.h>
 
+#include "cmdline.h"
+#include "hashmap.h"
+#include "intern.h"
 #include "linenoise.h"
 #include "utils.h"
 
@@ -20,33 +28,106 @@ typedef struct __params {
 } params;
 
 /*
- * cmd_list is mantain in singly linked-list.
+ * cmd_map is a hashmap from command name to cmd_element.
  * waiting_cmd is a queue with singly linked-list.
  * pfd_list is mantain in circular linked-list.
+ *
+ * cmd_map is read-only once the server is running, the others belong to a
+ * thread, so every server worker has its own pfd registry and epoll. The
+ * pfd_element of a thread come from its pfd_slab.
  */
-static cmd_element *cmd_list = NULL;
-static waiting_cmd *waiting_queue_Head = NULL;
-static waiting_cmd *waiting_queue_Rear = NULL;
-static pfd_element *pfd_list = NULL;
+static hashmap cmd_map;
+static __thread waiting_cmd *waiting_queue_Head = NULL;
+static __thread waiting_cmd *waiting_queue_Rear = NULL;
+static __thread pfd_element *pfd_list = NULL;
+static __thread int pfd_epoll = -1;
+static __thread slab pfd_slab = SLAB_INIT(pfd_element);
+
+/*
+ * pfd_closed keeps the pfd closed while a batch of events is handled, a
+ * later event of the batch may still point to one. wait_pfd() gives them
+ * back to pfd_slab before the next batch, a stale event finds fdtype 0.
+ */
+static __thread pfd_element *pfd_closed = NULL;
 
 int do_external_binary(cmd_element bin_cmd, char *params, ...) {
     char **params_list = parse_params(params, 1);
-    params_list[0] = bin_cmd.name;
+    params_list[0] = (char *)bin_cmd.name;
 
     execv(bin_cmd.fullname, params_list);
     return -1;
 }
 
-int do_pipe(cmd_element pipe, char *params, ...) {
-    FILE *read, *write;
-    if ((read = fdopen(STDIN_FILENO, "r")) == NULL) return -1;
-    if ((write = fdopen(STDOUT_FILENO, "w")) == NULL) return -1;
-    int c;
-    while ((c = fgetc(read)) != EOF) {
-        fputc(c, write);
+#define SSC_PIPE_CHUNK (64 * 1024) /* bytes moved by one call of do_pipe */
+
+/*
+ * wait_fd() waits for events on fd, a stage may be given the non-blocking
+ * socket of the user.
+ */
+static void wait_fd(int fd, short events) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    poll(&pfd, 1, -1);
+}
+
+static int copy_buf(int in, int out, char *buf) {
+    while (1) {
+        ssize_t len = read(in, buf, SSC_PIPE_CHUNK);
+        if (len == 0) return 0;
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return -1;
+            wait_fd(in, POLLIN);
+            continue;
+        }
+        for (ssize_t off = 0; off < len;) {
+            ssize_t n = write(out, buf + off, len - off);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN) return -1;
+                wait_fd(out, POLLOUT);
+                continue;
+            }
+            off += n;
+        }
     }
+}
 
-    return 0;
+/*
+ * copy_fd() keeps its buffer on the heap, a console forked by a job runs
+ * on the small stack of a coroutine.
+ */
+static int copy_fd(int in, int out) {
+    char *buf = malloc(SSC_PIPE_CHUNK);
+    if (buf == NULL) return -1;
+    int rtv = copy_buf(in, out, buf);
+    free(buf);
+    return rtv;
+}
+
+/*
+ * do_pipe() copies its input to its output, it is the "|" stage of the
+ * local console. The server never runs it: its pipelines connect the
+ * stages on both sides of "|" directly, and exec_read() splices their
+ * output to the socket. splice() moves the data in the kernel when either
+ * side is a pipe, which is the case unless "|" is the whole pipeline, then
+ * it falls back to read() and write().
+ */
+int do_pipe(cmd_element pipe, char *params, ...) {
+    while (1) {
+        ssize_t len = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL,
+                             SSC_PIPE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (len == 0) return 0;
+        if (len > 0) continue;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN) {
+            /* the side which would block isn't told, wait for both */
+            wait_fd(STDIN_FILENO, POLLIN);
+            wait_fd(STDOUT_FILENO, POLLOUT);
+            continue;
+        }
+        if (errno == EINVAL) return copy_fd(STDIN_FILENO, STDOUT_FILENO);
+        return -1;
+    }
 }
 
 int do_quit(cmd_element quit, char *params, ...) {
@@ -60,23 +141,39 @@ int do_quit(cmd_element quit, char *params, ...) {
     return -1;
 }
 
+static void free_cmd(cmd_element *cmd) {
+    while (cmd->params) {
+        params *p = cmd->params;
+        cmd->params = cmd->params->next;
+        free(p);
+    }
+    intern_release(cmd->name);
+    intern_release(cmd->fullname);
+}
+
 /*
- * This will append command(cmd) into cmd_list.
+ * This will insert command(cmd) into cmd_map. A command registered later
+ * replaces the one with the same name, e.g. builtin over binary in PATH.
  */
 int add_command(cmd_element cmd) {
+    if (cmd.name == NULL || cmd.fullname == NULL) return -1;
+
+    cmd_element *old_cmd = hashmap_get(&cmd_map, cmd.name);
+    if (old_cmd) {
+        /* keep the address, it may be referred by waiting_cmd */
+        free_cmd(old_cmd);
+        memcpy(old_cmd, &cmd, sizeof(cmd_element));
+        return hashmap_put(&cmd_map, old_cmd->name, old_cmd);
+    }
+
     cmd_element *new_cmd = malloc(sizeof(cmd_element));
     if (new_cmd == NULL) return -1;
 
     memcpy(new_cmd, &cmd, sizeof(cmd_element));
-    new_cmd->next = NULL;
-
-    if (!cmd_list) {
-        cmd_list = new_cmd;
-        return 0;
+    if (hashmap_put(&cmd_map, new_cmd->name, new_cmd) == -1) {
+        free(new_cmd);
+        return -1;
     }
-
-    new_cmd->next = cmd_list;
-    cmd_list = new_cmd;
     return 0;
 }
 
@@ -102,10 +199,12 @@ int add_param(cmd_element *cmd, char *param) {
  */
 int add_builtin_command(char *cmd_name, char *param, cmd_callback operation) {
     cmd_element cmd;
-    strcpy(cmd.name, cmd_name);
-    strcpy(cmd.fullname, cmd_name);
+    cmd.name = intern(cmd_name);
+    cmd.fullname = intern(cmd_name);
+    cmd.type = SSC_CMD_BUILTIN;
     cmd.operation = operation;
     cmd.params = NULL;
+    cmd.stat = 0;
 
     /* dealing with parameter */
     if (param) {
@@ -148,10 +247,7 @@ int append_queue(waiting_cmd cmd) {
 
 cmd_element *check_cmd(char *cmd_name) {
     if (cmd_name == NULL) return NULL;
-    for (cmd_element *ptr = cmd_list; ptr; ptr = ptr->next) {
-        if (strcmp(cmd_name, ptr->name) == 0) return ptr;
-    }
-    return NULL;
+    return hashmap_get(&cmd_map, cmd_name);
 }
 
 struct __pfd_element *get_pfd(int flag) {
@@ -171,18 +267,23 @@ struct __pfd_element *get_pfd(int flag) {
  */
 pfd_element *add_pfd(int fd[2], int fdtype) {
     if (pfd_list == NULL) {
-        pfd_list = malloc(sizeof(pfd_element));
+        if ((pfd_list = slab_alloc(&pfd_slab)) == NULL) return NULL;
         pfd_list->next = pfd_list->prev = pfd_list;
         pfd_list->read = fd[0];
         pfd_list->write = fd[1];
         pfd_list->fdtype = fdtype;
+        pfd_list->events = 0;
+        pfd_list->owner = NULL;
         return pfd_list;
     }
 
-    pfd_element *new_pfd = malloc(sizeof(pfd_element));
+    pfd_element *new_pfd = slab_alloc(&pfd_slab);
+    if (new_pfd == NULL) return NULL;
     new_pfd->read = fd[0];
     new_pfd->write = fd[1];
     new_pfd->fdtype = fdtype;
+    new_pfd->events = 0;
+    new_pfd->owner = NULL;
     pfd_list->next->prev = new_pfd;
     new_pfd->next = pfd_list->next;
 
@@ -193,24 +294,99 @@ pfd_element *add_pfd(int fd[2], int fdtype) {
     return pfd_list;
 }
 
+/*
+ * A forked console shares the epoll instance of its worker, EPOLL_CLOEXEC
+ * doesn't act on fork(), so an epoll_ctl() of the console would change
+ * what the worker watches. The child lets go of the instance instead, none
+ * of its pfds is watched then, and watch_pfd() makes a new one if needed.
+ */
+static void pfd_after_fork() {
+    if (pfd_epoll == -1) return;
+    close(pfd_epoll);
+    pfd_epoll = -1;
+
+    if (pfd_list == NULL) return;
+    pfd_element *pfd = pfd_list;
+    do {
+        pfd->events = 0;
+        pfd = pfd->next;
+    } while (pfd != pfd_list);
+}
+
+static void pfd_atfork() { pthread_atfork(NULL, NULL, pfd_after_fork); }
+
+/*
+ * watch_pfd() registers pfd->read into the epoll instance owned by the pfd
+ * registry, or changes its interest set if it is watched already. Every
+ * event reported by wait_pfd() carries the pfd in data.ptr.
+ */
+int watch_pfd(pfd_element *pfd, uint32_t events) {
+    if (pfd == NULL) return -1;
+    if (pfd_epoll == -1) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_once(&once, pfd_atfork);
+        if ((pfd_epoll = epoll_create1(EPOLL_CLOEXEC)) == -1) return -1;
+    }
+
+    struct epoll_event ev = {.events = events, .data.ptr = pfd};
+    int op = (pfd->events) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(pfd_epoll, op, pfd->read, &ev) == -1) return -1;
+
+    pfd->events = events;
+    return 0;
+}
+
+int unwatch_pfd(pfd_element *pfd) {
+    if (pfd == NULL || pfd->events == 0) return 0;
+
+    /*
+     * The fd may be shared with a forked child, so closing it doesn't
+     * guarantee it leaves the epoll interest list. Remove it explicitly.
+     */
+    epoll_ctl(pfd_epoll, EPOLL_CTL_DEL, pfd->read, NULL);
+    pfd->events = 0;
+    return 0;
+}
+
+int wait_pfd(struct epoll_event *events, int maxevents, int timeout) {
+    if (pfd_epoll == -1) return 0;
+    while (pfd_closed) {
+        pfd_element *pfd = pfd_closed;
+        pfd_closed = pfd->next;
+        slab_free(&pfd_slab, pfd);
+    }
+    return epoll_wait(pfd_epoll, events, maxevents, timeout);
+}
+
+static void free_pfd(pfd_element *pfd) {
+    if (pfd_epoll == -1) {
+        slab_free(&pfd_slab, pfd);
+        return;
+    }
+    pfd->fdtype = 0;
+    pfd->owner = NULL;
+    pfd->next = pfd_closed;
+    pfd_closed = pfd;
+}
+
 int close_pfd(pfd_element *pfd) {
     if (pfd == NULL) return 0;
 
+    unwatch_pfd(pfd);
     close(pfd->read);
-    close(pfd->write);
+    /* a socket or a pidfd is both ends, another thread may reuse the fd */
+    if (pfd->write != pfd->read) close(pfd->write);
 
     if (pfd_list == pfd) {
         pfd_list = pfd->prev;
     }
     if (pfd->prev == pfd) {
-        free(pfd);
         pfd_list = NULL;
-        return 0;
+    } else {
+        pfd->prev->next = pfd->next;
+        pfd->next->prev = pfd->prev;
     }
-
-    pfd->prev->next = pfd->next;
-    pfd->next->prev = pfd->prev;
-    free(pfd);
+    free_pfd(pfd);
     return 0;
 }
 
@@ -296,72 +472,6 @@ int exec_all_waiting_cmd() {
     return 0;
 }
 
-/*
- * The usage of cmdtok is similar to the strtok but the different is
- * you need to free() the return string(char*) every time before you call.
- */
-char *cmdtok(char *s, char *special_sign) {
-    static char *last;
-    char *cmd;
-
-    if (s) last = s;
-    if (s == NULL && (s = last) == NULL) return NULL;
-
-    char c;
-    // eliminate the space from begin
-    for (; (c = *s); s++) {
-        if (c == ' ')
-            continue;
-        else
-            break;
-    }
-
-    if (*s == 0) {
-        last = NULL;
-        return NULL;
-    }
-
-    // check if *s is special_sign and eliminate the consecutive special_sign.
-    for (char *spec = special_sign; (c = *spec++) != 0;) {
-        if (*s == c) {
-            if ((cmd = malloc(sizeof(char) + 1)) == NULL) {
-                return NULL;
-            }
-            cmd[0] = c;
-            cmd[1] = '\0';
-            last = ++s;
-
-            return cmd;
-        }
-    }
-
-    // if not in special_sign, read following command to next special_sign
-    for (; (c = *s) != 0; s++) {
-        for (char *spec = special_sign; *spec != 0; spec++) {
-            if (c == *spec) {
-                int length = s - last;
-                if ((cmd = malloc(length + 1)) == NULL) {
-                    return NULL;
-                }
-                memcpy(cmd, last, length);
-                cmd[length] = '\0';
-                last = s;
-
-                return cmd;
-            }
-        }
-    }
-
-    int length = s - last;
-    if ((cmd = malloc(length + 1)) == NULL) {
-        return NULL;
-    }
-    memcpy(cmd, last, length);
-    cmd[length] = '\0';
-    last = s;
-    return cmd;
-}
-
 int console_start(fd_t fd_in, fd_t fd_out, fd_t fd_err) {
     if (fd_in > 2) dup2(fd_in, STDIN_FILENO);
     if (fd_out > 2) dup2(fd_out, STDOUT_FILENO);
@@ -376,14 +486,16 @@ int console_start(fd_t fd_in, fd_t fd_out, fd_t fd_err) {
         linenoiseHistorySave(".console.history");
 
         /* put command into waiting queue */
-        char *split = cmdtok(line, "|");
-        for (; split; split = cmdtok(NULL, "|")) {
-            char *name = strtok(split, " ");
-            char *param = strtok(NULL, "");
+        cmd_line cl;
+        int len = cmdline_parse(line, &cl);
+        if (len == -1) printf("%s\n", cl.error);
+        for (int n = 0; n < len; n++) {
+            char *name = cl.stages[n].name;
+            char *param = cl.stages[n].param;
 
             cmd_element *cmd_addr;
             if ((cmd_addr = check_cmd(name)) == NULL) {
-                printf("command not found: %s DOESN'T EXIST\n", split);
+                printf("command not found: %s DOESN'T EXIST\n", name);
                 break;
             }
 
@@ -403,7 +515,6 @@ int console_start(fd_t fd_in, fd_t fd_out, fd_t fd_err) {
             wait_cmd.next = NULL;
 
             if (append_queue(wait_cmd) == -1) return -1;
-            free(split);
         }
 
         // showall_waiting_cmd();
@@ -421,17 +532,12 @@ int console_start(fd_t fd_in, fd_t fd_out, fd_t fd_err) {
 int console_close(fd_t fd_in, fd_t fd_out, fd_t fd_err) {
     /* TODO: */
     printf("Closing: free all allocated resource\n");
-    while (cmd_list) {
-        cmd_element *free_ptr = cmd_list;
-        cmd_list = cmd_list->next;
-
-        while (free_ptr->params) {
-            params *p = free_ptr->params;
-            free_ptr->params = free_ptr->params->next;
-            free(p);
-        }
-        free(free_ptr);
+    size_t iter = 0;
+    for (hashmap_entry *e; (e = hashmap_next(&cmd_map, &iter));) {
+        free_cmd(e->value);
+        free(e->value);
     }
+    hashmap_free(&cmd_map);
     return 1;
 }
 
@@ -455,10 +561,12 @@ int commands_init(char *path) {
             if (is_executable(fullname)) {
                 /* initialize cmd value */
                 cmd_element cmd;
-                strcpy(cmd.fullname, fullname);
-                strcpy(cmd.name, file->d_name);
+                cmd.fullname = intern(fullname);
+                cmd.name = intern(file->d_name);
+                cmd.type = SSC_CMD_EXTERNAL;
                 cmd.operation = do_external_binary;
                 cmd.params = NULL;
+                cmd.stat = 0;
 
                 if (add_command(cmd) == -1) return -1;
             }
@@ -484,7 +592,9 @@ void completion(const char *buf, linenoiseCompletions *lc) {
 // DEBUG
 void showall_cmd() {
     printf("-------- Accepted command --------\n");
-    for (cmd_element *head = cmd_list; head; head = head->next) {
+    size_t iter = 0;
+    for (hashmap_entry *e; (e = hashmap_next(&cmd_map, &iter));) {
+        cmd_element *head = e->value;
         printf("| %-32s|\n", head->name);
         for (params *p = head->params; p; p = p->next) {
             printf("| - %-30s|\n", p->value);
@@ -1,5 +1,8 @@
+#include <stdint.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 
+#include "arena.h"
 #include "linenoise.h"
 #ifndef LINENOISE_MAX_LINE
 /*
@@ -17,6 +20,18 @@
 #define SSC_SOCK_CLIENT 0b00100
 #define SSC_WFIFO       0b01000
 #define SSC_RFIFO       0b10000
+#define SSC_PIDFD       0b100000
+#define SSC_EVENT       0b1000000
+#define SSC_SOCK_DB     0b10000000
+#define SSC_SOCK_STATS  0b100000000  /* listening socket of the metrics */
+#define SSC_SOCK_SCRAPE 0b1000000000 /* a connection to the metrics */
+#define SSC_EXEC_OUT    0b10000000000 /* output of a user's pipeline */
+#define SSC_TIMER       0b100000000000 /* the heartbeat of the store */
+#define SSC_STORE       0b1000000000000 /* wakes jobs waiting for the store */
+
+#define SSC_CMD_EXTERNAL 0b001 /* binary found by commands_init() */
+#define SSC_CMD_BUILTIN  0b010 /* callback from add_builtin_command() */
+#define SSC_CMD_INPROC   0b100 /* builtin safe to run without fork() */
 
 
 typedef long int fd_t;
@@ -25,17 +40,28 @@ struct __pfd_element;
 
 typedef int (*cmd_callback)(struct __cmd_element, char *, ...);
 
+/*
+ * name and fullname are interned strings, see intern.h. stat is the id of
+ * the command in the stats of the server (see stats.h), 0 if it has none.
+ */
 typedef struct __cmd_element {
-    char name[LINENOISE_MAX_LINE];
-    char fullname[LINENOISE_MAX_LINE];
+    const char *name;
+    const char *fullname;
+    int type;
     cmd_callback operation;
     struct __params *params;
-    struct __cmd_element *next;
+    int stat;
 } cmd_element;
 
+/*
+ * owner is whatever the fd belongs to (e.g. the chatroom user of a client
+ * socket), events is the epoll interest set, 0 if the fd is not watched.
+ */
 typedef struct __pfd_element {
     int read, write;
     int fdtype;
+    uint32_t events;
+    void *owner;
     struct __pfd_element *next, *prev;
 } pfd_element;
 
@@ -52,8 +78,6 @@ int console_start(fd_t, fd_t, fd_t);
 int console_close(fd_t, fd_t, fd_t);
 int commands_init(char *path);
 
-char *cmdtok(char *s, char *special_sign);
-
 int add_command(struct __cmd_element cmd);
 int add_builtin_command(char *cmd_name, char *param, cmd_callback operation);
 cmd_element *check_cmd(char *cmd_name);
@@ -62,6 +86,9 @@ struct __pfd_element *add_pfd(int fd[2], int fdtype);
 int close_pfd(struct __pfd_element *pfd);
 int close_all_pfd(int fdtype);
 struct __pfd_element *get_pfd(int);
+int watch_pfd(struct __pfd_element *pfd, uint32_t events);
+int unwatch_pfd(struct __pfd_element *pfd);
+int wait_pfd(struct epoll_event *events, int maxevents, int timeout);
 
 int append_queue(waiting_cmd cmd);
 int free_all_waiting_cmd();
@@ -0,0 +1,92 @@
+#include "coro.h"
+
+#include <stdlib.h>
+#include <ucontext.h>
+
+#define CORO_STACK_SIZE (64 * 1024)
+#define CORO_MAX_FREE 64 /* finished coroutines kept for reuse */
+
+struct __coro {
+    ucontext_t ctx, caller;
+    void (*fn)(void *);
+    void (*done)(void *);
+    void *arg;
+    int finished;
+    char *stack;
+    struct __coro *next_free;
+};
+
+static __thread coro *coro_current = NULL;
+static __thread coro *coro_free_list = NULL;
+static __thread int coro_free_len = 0;
+
+static void coro_entry() {
+    coro *c = coro_current;
+    c->fn(c->arg);
+    c->finished = 1;
+    /* returning switches to uc_link, the caller of coro_resume() */
+}
+
+coro *coro_new(void (*fn)(void *), void (*done)(void *), void *arg) {
+    coro *c = coro_free_list;
+    if (c) {
+        coro_free_list = c->next_free;
+        coro_free_len--;
+    } else {
+        if ((c = malloc(sizeof(coro))) == NULL) return NULL;
+        if ((c->stack = malloc(CORO_STACK_SIZE)) == NULL) {
+            free(c);
+            return NULL;
+        }
+    }
+
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = c->stack;
+    c->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    c->ctx.uc_link = &c->caller;
+    makecontext(&c->ctx, coro_entry, 0);
+
+    c->fn = fn;
+    c->done = done;
+    c->arg = arg;
+    c->finished = 0;
+    return c;
+}
+
+static void coro_release(coro *c) {
+    if (coro_free_len >= CORO_MAX_FREE) {
+        free(c->stack);
+        free(c);
+        return;
+    }
+    c->next_free = coro_free_list;
+    coro_free_list = c;
+    coro_free_len++;
+}
+
+/*
+ * coro_resume() returns 1 if the coroutine finished, 0 if it yielded.
+ */
+int coro_resume(coro *c) {
+    coro *prev = coro_current;
+    coro_current = c;
+    swapcontext(&c->caller, &c->ctx);
+    coro_current = prev;
+
+    if (!c->finished) return 0;
+    if (c->done) c->done(c->arg);
+    coro_release(c);
+    return 1;
+}
+
+void coro_yield() {
+    coro *c = coro_current;
+    if (c) swapcontext(&c->ctx, &c->caller);
+}
+
+/*
+ * coro_self() is NULL outside of any coroutine.
+ */
+coro *coro_self() { return coro_current; }
+
+void *coro_data(coro *c) { return (c) ? c->arg : NULL; }
@@ -0,0 +1,18 @@
+#ifndef SIMPLE_SERVER_CORO_H
+#define SIMPLE_SERVER_CORO_H
+
+/*
+ * coro is a stackful coroutine of the calling thread. fn(arg) runs on its
+ * own stack until it calls coro_yield(), and continues where it stopped on
+ * the next coro_resume(). done(arg) is called by the coro_resume() which
+ * sees fn return, after that the coroutine is recycled.
+ */
+typedef struct __coro coro;
+
+coro *coro_new(void (*fn)(void *), void (*done)(void *), void *arg);
+int coro_resume(coro *c);
+void coro_yield();
+coro *coro_self();
+void *coro_data(coro *c);
+
+#endif /* SIMPLE_SERVER_CORO_H */
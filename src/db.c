@@ -0,0 +1,238 @@
+#include "db.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "async.h"
+#include "coro.h"
+#include "stats.h"
+
+typedef struct __db_wait {
+    coro *co;
+    redisReply *reply;
+} db_wait;
+
+typedef struct __db_sub {
+    db_message_cb cb;
+} db_sub;
+
+static __thread redisAsyncContext *db_ac = NULL;
+static __thread redisAsyncContext *db_sub_ac = NULL;
+static __thread redisContext *db_sync = NULL;
+
+redisContext *db_connect() {
+    redisContext *c = redisConnect(SSC_REDIS_IP, SSC_REDIS_PORT);
+    if (c == NULL || c->err) {
+        if (c) {
+            printf("Error: %s\n", c->errstr);
+            redisFree(c);
+        } else {
+            printf("Can't allocate redis context\n");
+        }
+        return NULL;
+    }
+    return c;
+}
+
+/*
+ * The forked child shares the sockets of its parent, it must neither read
+ * the parent's replies nor suspend on them. Forget the contexts, the child
+ * connects again when it needs redis.
+ */
+static void db_after_fork() {
+    db_ac = NULL;
+    db_sub_ac = NULL;
+    db_sync = NULL;
+}
+
+/*
+ * The event hooks of an async context get its pfd, which remembers the
+ * events being watched.
+ */
+static void db_update_events(pfd_element *pfd, uint32_t events) {
+    if (events == pfd->events) return;
+    if (events) {
+        watch_pfd(pfd, events);
+    } else {
+        unwatch_pfd(pfd);
+    }
+}
+
+static void db_add_read(void *privdata) {
+    pfd_element *pfd = privdata;
+    db_update_events(pfd, pfd->events | EPOLLIN);
+}
+
+static void db_del_read(void *privdata) {
+    pfd_element *pfd = privdata;
+    db_update_events(pfd, pfd->events & ~EPOLLIN);
+}
+
+static void db_add_write(void *privdata) {
+    pfd_element *pfd = privdata;
+    db_update_events(pfd, pfd->events | EPOLLOUT);
+}
+
+static void db_del_write(void *privdata) {
+    pfd_element *pfd = privdata;
+    db_update_events(pfd, pfd->events & ~EPOLLOUT);
+}
+
+static void db_cleanup(void *privdata) { db_update_events(privdata, 0); }
+
+static void db_connected(const redisAsyncContext *ac, int status) {
+    if (status == REDIS_OK) return;
+    printf("Error: %s\n", ac->errstr);
+    exit(EXIT_FAILURE);
+}
+
+static void db_disconnected(const redisAsyncContext *ac, int status) {
+    printf("Redis server disconnected: %s\n",
+           (status == REDIS_OK) ? "closed" : ac->errstr);
+    exit(EXIT_FAILURE);
+}
+
+static void db_atfork() { pthread_atfork(NULL, NULL, db_after_fork); }
+
+/*
+ * db_open() connects an async context watched by the event loop of the
+ * thread, the pfd owner is the context.
+ */
+static redisAsyncContext *db_open(int options) {
+    redisOptions opt = {0};
+    REDIS_OPTIONS_SET_TCP(&opt, SSC_REDIS_IP, SSC_REDIS_PORT);
+    opt.options |= options;
+
+    redisAsyncContext *ac = redisAsyncConnectWithOptions(&opt);
+    if (ac == NULL || ac->err) {
+        printf("Error: %s\n", (ac) ? ac->errstr : "Can't connect redis");
+        return NULL;
+    }
+
+    int fd[2] = {ac->c.fd, ac->c.fd};
+    pfd_element *pfd = add_pfd(fd, SSC_SOCK_DB);
+    pfd->owner = ac;
+
+    ac->ev.data = pfd;
+    ac->ev.addRead = db_add_read;
+    ac->ev.delRead = db_del_read;
+    ac->ev.addWrite = db_add_write;
+    ac->ev.delWrite = db_del_write;
+    ac->ev.cleanup = db_cleanup;
+    redisAsyncSetConnectCallback(ac, db_connected);
+    redisAsyncSetDisconnectCallback(ac, db_disconnected);
+
+    /* the connection is in progress, wait until the socket is writable */
+    db_add_write(pfd);
+    return ac;
+}
+
+int db_init() {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, db_atfork);
+
+    db_ac = db_open(REDIS_OPT_NOAUTOFREEREPLIES);
+    return (db_ac == NULL) ? -1 : 0;
+}
+
+void db_handler(pfd_element *pfd, uint32_t events) {
+    redisAsyncContext *ac = pfd->owner;
+    if (ac == NULL) return;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) redisAsyncHandleRead(ac);
+    if (events & EPOLLOUT) redisAsyncHandleWrite(ac);
+}
+
+static void db_message(redisAsyncContext *ac, void *reply, void *privdata) {
+    redisReply *r = reply;
+    db_sub *sub = privdata;
+    if (r == NULL || r->type != REDIS_REPLY_ARRAY || r->elements < 3) return;
+
+    const char *kind = r->element[0]->str;
+    if (strcmp(kind, "psubscribe") == 0) {
+        sub->cb(NULL, NULL);
+    } else if (strcmp(kind, "pmessage") == 0 && r->elements == 4) {
+        sub->cb(r->element[2]->str, r->element[3]->str);
+    }
+}
+
+/*
+ * db_subscribe() calls cb(channel, message) for every message published to
+ * a channel matching pattern. cb(NULL, NULL) is called once the
+ * subscription is active. The subscription has its own connection.
+ */
+int db_subscribe(const char *pattern, db_message_cb cb) {
+    if (db_sub_ac == NULL && (db_sub_ac = db_open(0)) == NULL) return -1;
+
+    db_sub *sub = malloc(sizeof(db_sub));
+    if (sub == NULL) return -1;
+    sub->cb = cb;
+    if (redisAsyncCommand(db_sub_ac, db_message, sub, "PSUBSCRIBE %s",
+                          pattern) != REDIS_OK) {
+        free(sub);
+        return -1;
+    }
+    return 0;
+}
+
+static void db_resume(redisAsyncContext *ac, void *reply, void *privdata) {
+    db_wait *wait = privdata;
+    if (reply == NULL) {
+        printf("Error: redis connection lost\n");
+        exit(EXIT_FAILURE);
+    }
+    wait->reply = reply;
+    coro_resume(wait->co);
+}
+
+static void db_discard(redisAsyncContext *ac, void *reply, void *privdata) {
+    if (reply) freeReplyObject(reply);
+}
+
+static redisContext *db_blocking() {
+    if (db_sync == NULL && (db_sync = db_connect()) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return db_sync;
+}
+
+redisReply *db_command(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+
+    uint64_t start = stats_now();
+    redisReply *reply = NULL;
+    coro *co = coro_self();
+    if (co && db_ac) {
+        db_wait wait = {.co = co, .reply = NULL};
+        int rtv = redisvAsyncCommand(db_ac, db_resume, &wait, fmt, ap);
+        va_end(ap);
+        if (rtv != REDIS_OK) return NULL;
+
+        coro_yield();
+        reply = wait.reply;
+    } else {
+        reply = redisvCommand(db_blocking(), fmt, ap);
+        va_end(ap);
+    }
+    stats_add(STAT_DB_COMMANDS, 1);
+    stats_record(HIST_DB, stats_now() - start);
+    return reply;
+}
+
+/*
+ * db_send() sends a command whose reply nobody waits for.
+ */
+void db_send(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    stats_add(STAT_DB_SENT, 1);
+    if (db_ac) {
+        redisvAsyncCommand(db_ac, db_discard, NULL, fmt, ap);
+    } else {
+        redisReply *reply = redisvCommand(db_blocking(), fmt, ap);
+        if (reply) freeReplyObject(reply);
+    }
+    va_end(ap);
+}
@@ -0,0 +1,32 @@
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "console.h"
+#include "hiredis.h"
+
+#ifndef SIMPLE_SERVER_DB_H
+#define SIMPLE_SERVER_DB_H
+
+#define SSC_REDIS_IP "127.0.0.1"
+#define SSC_REDIS_PORT 6379
+
+/*
+ * Every worker talks to redis through an async context watched by its
+ * event loop. db_command() called inside a coroutine (see coro.h) sends
+ * the command and suspends the coroutine until the reply arrives, so other
+ * users keep being served. Anywhere else, e.g. in a forked console, it
+ * falls back to a blocking connection of the thread.
+ *
+ * Replies are never freed by hiredis, the caller owns them as with
+ * redisCommand().
+ */
+typedef void (*db_message_cb)(const char *channel, const char *message);
+
+redisContext *db_connect();
+int db_init();
+void db_handler(struct __pfd_element *pfd, uint32_t events);
+redisReply *db_command(const char *fmt, ...);
+void db_send(const char *fmt, ...);
+int db_subscribe(const char *pattern, db_message_cb cb);
+
+#endif /* SIMPLE_SERVER_DB_H */
@@ -0,0 +1,125 @@
+#include "hashmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+/* a deleted slot, probing must go through it. */
+static const char hashmap_tomb[1];
+#define HASHMAP_TOMB (hashmap_tomb)
+
+static inline int slot_used(hashmap_entry *e) {
+    return e->key && e->key != HASHMAP_TOMB;
+}
+
+int hashmap_init(hashmap *map, size_t cap) {
+    size_t c = 8;
+    while (c < cap) c <<= 1;
+
+    map->slots = calloc(c, sizeof(hashmap_entry));
+    if (map->slots == NULL) return -1;
+    map->cap = c;
+    map->len = map->tombs = 0;
+    return 0;
+}
+
+void hashmap_free(hashmap *map) {
+    free(map->slots);
+    map->slots = NULL;
+    map->cap = map->len = map->tombs = 0;
+}
+
+/*
+ * find_slot() returns the slot holding key, or NULL if key isn't in map.
+ */
+static hashmap_entry *find_slot(hashmap *map, const char *key, uint32_t hash) {
+    if (map->cap == 0) return NULL;
+
+    size_t mask = map->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        hashmap_entry *e = &map->slots[i];
+        if (e->key == NULL) return NULL;
+        if (e->key != HASHMAP_TOMB && e->hash == hash &&
+            strcmp(e->key, key) == 0)
+            return e;
+    }
+}
+
+static int hashmap_resize(hashmap *map, size_t cap) {
+    hashmap_entry *old = map->slots;
+    size_t old_cap = map->cap;
+
+    if (hashmap_init(map, cap) == -1) {
+        map->slots = old;
+        map->cap = old_cap;
+        return -1;
+    }
+
+    size_t mask = map->cap - 1;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!slot_used(&old[i])) continue;
+
+        size_t j = old[i].hash & mask;
+        while (map->slots[j].key) j = (j + 1) & mask;
+        map->slots[j] = old[i];
+        map->len++;
+    }
+    free(old);
+    return 0;
+}
+
+void *hashmap_get(hashmap *map, const char *key) {
+    hashmap_entry *e = find_slot(map, key, str_hash(key));
+    return (e) ? e->value : NULL;
+}
+
+/*
+ * hashmap_put() inserts key, or replaces the value if key exists already.
+ */
+int hashmap_put(hashmap *map, const char *key, void *value) {
+    uint32_t hash = str_hash(key);
+    hashmap_entry *e = find_slot(map, key, hash);
+    if (e) {
+        e->key = key;
+        e->value = value;
+        return 0;
+    }
+
+    /* keep the load (including tombstones) under 3/4 */
+    if ((map->len + map->tombs + 1) * 4 > map->cap * 3) {
+        size_t cap = (map->len + 1) * 2;
+        if (hashmap_resize(map, cap < map->cap ? map->cap : cap) == -1)
+            return -1;
+    }
+
+    size_t mask = map->cap - 1;
+    size_t i = hash & mask;
+    while (slot_used(&map->slots[i])) i = (i + 1) & mask;
+
+    if (map->slots[i].key == HASHMAP_TOMB) map->tombs--;
+    map->slots[i].key = key;
+    map->slots[i].hash = hash;
+    map->slots[i].value = value;
+    map->len++;
+    return 0;
+}
+
+void *hashmap_del(hashmap *map, const char *key) {
+    hashmap_entry *e = find_slot(map, key, str_hash(key));
+    if (e == NULL) return NULL;
+
+    void *value = e->value;
+    e->key = HASHMAP_TOMB;
+    e->value = NULL;
+    map->len--;
+    map->tombs++;
+    return value;
+}
+
+hashmap_entry *hashmap_next(hashmap *map, size_t *iter) {
+    for (; *iter < map->cap; (*iter)++) {
+        if (slot_used(&map->slots[*iter])) return &map->slots[(*iter)++];
+    }
+    return NULL;
+}
@@ -0,0 +1,35 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef SIMPLE_SERVER_HASHMAP_H
+#define SIMPLE_SERVER_HASHMAP_H
+
+/*
+ * hashmap is an open-addressing (linear probing) table keyed by C string.
+ * The map doesn't own the keys, so a key must stay valid and unchanged
+ * while it is inside the map (e.g. an interned string).
+ */
+typedef struct __hashmap_entry {
+    const char *key;
+    uint32_t hash;
+    void *value;
+} hashmap_entry;
+
+typedef struct __hashmap {
+    hashmap_entry *slots;
+    size_t cap, len, tombs;
+} hashmap;
+
+int hashmap_init(hashmap *map, size_t cap);
+void hashmap_free(hashmap *map);
+void *hashmap_get(hashmap *map, const char *key);
+int hashmap_put(hashmap *map, const char *key, void *value);
+void *hashmap_del(hashmap *map, const char *key);
+
+/*
+ * hashmap_next() iterates over the map, start with *iter = 0 and stop when
+ * NULL is returned.
+ */
+hashmap_entry *hashmap_next(hashmap *map, size_t *iter);
+
+#endif /* SIMPLE_SERVER_HASHMAP_H */
@@ -0,0 +1,56 @@
+#include "intern.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+typedef struct __intern_str {
+    int refcnt;
+    char str[];
+} intern_str;
+
+/*
+ * Commands are interned before the workers start, user names by the workers
+ * when somebody logs in, so the map is shared under intern_lock.
+ */
+static hashmap intern_map;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *intern(const char *str) {
+    if (str == NULL) return NULL;
+
+    pthread_mutex_lock(&intern_lock);
+    intern_str *is = hashmap_get(&intern_map, str);
+    if (is) {
+        is->refcnt++;
+        pthread_mutex_unlock(&intern_lock);
+        return is->str;
+    }
+
+    size_t len = strlen(str);
+    if ((is = malloc(sizeof(intern_str) + len + 1)) != NULL) {
+        is->refcnt = 1;
+        memcpy(is->str, str, len + 1);
+        if (hashmap_put(&intern_map, is->str, is) == -1) {
+            free(is);
+            is = NULL;
+        }
+    }
+    pthread_mutex_unlock(&intern_lock);
+    return (is) ? is->str : NULL;
+}
+
+void intern_release(const char *str) {
+    if (str == NULL) return;
+
+    intern_str *is = (intern_str *)(str - offsetof(intern_str, str));
+    pthread_mutex_lock(&intern_lock);
+    if (--is->refcnt == 0) {
+        hashmap_del(&intern_map, is->str);
+        free(is);
+    }
+    pthread_mutex_unlock(&intern_lock);
+}
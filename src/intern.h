@@ -0,0 +1,11 @@
+#ifndef SIMPLE_SERVER_INTERN_H
+#define SIMPLE_SERVER_INTERN_H
+
+/*
+ * intern() returns the canonical copy of str, equal strings share the same
+ * address until every reference has been given back by intern_release().
+ */
+const char *intern(const char *str);
+void intern_release(const char *str);
+
+#endif /* SIMPLE_SERVER_INTERN_H */
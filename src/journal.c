@@ -0,0 +1,347 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define JOURNAL_HEADER 8 /* payload length and checksum */
+
+static uint32_t journal_hash(const unsigned char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int jbuf_reserve(jbuf *b, size_t len) {
+    if (b->len + len <= b->cap) return 0;
+
+    size_t cap = (b->cap) ? b->cap : 4096;
+    while (cap < b->len + len) cap <<= 1;
+    char *data = realloc(b->data, cap);
+    if (data == NULL) return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+/*
+ * jbuf_record() encodes a record at the end of b, it returns the size of
+ * the record or -1.
+ */
+int jbuf_record(jbuf *b, int op, int argc, const char *const *argv) {
+    if (argc > SSC_JOURNAL_MAX_ARGS) return -1;
+
+    size_t payload = 2;
+    for (int i = 0; i < argc; i++) payload += 4 + strlen(argv[i]);
+    if (jbuf_reserve(b, JOURNAL_HEADER + payload) == -1) return -1;
+
+    unsigned char *rec = (unsigned char *)b->data + b->len;
+    unsigned char *p = rec + JOURNAL_HEADER;
+    *p++ = op;
+    *p++ = argc;
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        put_u32(p, len);
+        memcpy(p + 4, argv[i], len);
+        p += 4 + len;
+    }
+    put_u32(rec, payload);
+    put_u32(rec + 4, journal_hash(rec + JOURNAL_HEADER, payload));
+
+    b->len += JOURNAL_HEADER + payload;
+    return JOURNAL_HEADER + payload;
+}
+
+static int write_full(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * jbuf_flush() writes the content of b to fd and empties b.
+ */
+int jbuf_flush(jbuf *b, int fd) {
+    if (write_full(fd, b->data, b->len) == -1) return -1;
+    b->len = 0;
+    return 0;
+}
+
+void jbuf_free(jbuf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+/*
+ * journal_file() returns the malloc()ed name <path><suffix>, followed by
+ * .<gen> unless gen is 0.
+ */
+char *journal_file(const char *path, const char *suffix, unsigned long gen) {
+    size_t len = strlen(path) + strlen(suffix) + 24;
+    char *file = malloc(len);
+    if (file == NULL) return NULL;
+    if (gen) {
+        snprintf(file, len, "%s%s.%lu", path, suffix, gen);
+    } else {
+        snprintf(file, len, "%s%s", path, suffix);
+    }
+    return file;
+}
+
+/*
+ * journal_decode() calls cb for the record at p, it returns the size of
+ * the record, 0 if the record is torn or -1 if cb failed.
+ */
+static long journal_decode(const unsigned char *p, size_t left,
+                           journal_cb cb, void *arg) {
+    if (left < JOURNAL_HEADER) return 0;
+    uint32_t payload = get_u32(p);
+    if (payload < 2 || payload > left - JOURNAL_HEADER) return 0;
+
+    const unsigned char *data = p + JOURNAL_HEADER;
+    if (journal_hash(data, payload) != get_u32(p + 4)) return 0;
+
+    int op = data[0], argc = data[1];
+    if (argc > SSC_JOURNAL_MAX_ARGS) return 0;
+
+    /* arguments are copied to be NUL terminated */
+    char *copy = malloc(payload);
+    if (copy == NULL) return -1;
+
+    const char *argv[SSC_JOURNAL_MAX_ARGS];
+    const unsigned char *q = data + 2, *end = data + payload;
+    char *c = copy;
+    for (int i = 0; i < argc; i++) {
+        if (end - q < 4 || get_u32(q) > (size_t)(end - q - 4)) {
+            free(copy);
+            return 0;
+        }
+        uint32_t len = get_u32(q);
+        memcpy(c, q + 4, len);
+        c[len] = '\0';
+        argv[i] = c;
+        c += len + 1;
+        q += 4 + len;
+    }
+
+    int rtv = cb(arg, op, argc, argv);
+    free(copy);
+    return (rtv == -1) ? -1 : (long)(JOURNAL_HEADER + payload);
+}
+
+/*
+ * journal_replay() calls cb for every record of file and cuts off a torn
+ * tail. The size of the valid records is stored in *size. A missing file is
+ * an empty journal.
+ */
+int journal_replay(const char *file, journal_cb cb, void *arg, size_t *size) {
+    *size = 0;
+    int fd = open(file, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return (errno == ENOENT) ? 0 : -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    size_t off = 0;
+    int rtv = 0;
+    while (off < (size_t)st.st_size) {
+        long n = journal_decode(map + off, st.st_size - off, cb, arg);
+        if (n == -1) rtv = -1;
+        if (n <= 0) break;
+        off += n;
+    }
+    munmap(map, st.st_size);
+
+    if (rtv == 0 && off < (size_t)st.st_size) {
+        fprintf(stderr, "%s: torn record at %zu, truncated\n", file, off);
+        if (ftruncate(fd, off) == -1) rtv = -1;
+    }
+    close(fd);
+    *size = off;
+    return rtv;
+}
+
+int journal_open(journal *j, const char *path, unsigned long gen) {
+    memset(j, 0, sizeof(journal));
+    j->fd = -1;
+    j->gen = gen;
+    if ((j->path = strdup(path)) == NULL) return -1;
+    pthread_mutex_init(&j->lock, NULL);
+
+    char *file = journal_file(path, ".log", gen);
+    if (file == NULL) return -1;
+    j->fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    int rtv = (j->fd == -1) ? -1 : journal_sync_dir(file);
+    free(file);
+    if (rtv == -1) return -1;
+
+    struct stat st;
+    if (fstat(j->fd, &st) == -1) return -1;
+    j->size = st.st_size;
+    return 0;
+}
+
+/*
+ * journal_append() buffers a record, it returns the bytes pending. *seq is
+ * set to the count of bytes appended with the record, see journal_synced().
+ */
+size_t journal_append(journal *j, int op, int argc, const char *const *argv,
+                      unsigned long long *seq) {
+    pthread_mutex_lock(&j->lock);
+    if (!j->detached) {
+        int n = jbuf_record(&j->pending, op, argc, argv);
+        if (n == -1) {
+            perror("journal_append()");
+            exit(EXIT_FAILURE);
+        }
+        j->size += n;
+        j->appended += n;
+    }
+    *seq = j->appended;
+    size_t len = j->pending.len;
+    pthread_mutex_unlock(&j->lock);
+    return len;
+}
+
+size_t journal_pending(journal *j) {
+    pthread_mutex_lock(&j->lock);
+    size_t len = j->pending.len;
+    pthread_mutex_unlock(&j->lock);
+    return len;
+}
+
+unsigned long long journal_synced(journal *j) {
+    pthread_mutex_lock(&j->lock);
+    unsigned long long synced = j->synced;
+    pthread_mutex_unlock(&j->lock);
+    return synced;
+}
+
+/*
+ * journal_sync() makes every record appended so far durable. The pending
+ * buffer is swapped out, so appends go on during the disk I/O.
+ */
+int journal_sync(journal *j) {
+    pthread_mutex_lock(&j->lock);
+    jbuf batch = j->pending;
+    memset(&j->pending, 0, sizeof(jbuf));
+    int fd = j->fd;
+    unsigned long long seq = j->appended;
+    pthread_mutex_unlock(&j->lock);
+
+    int rtv = 0;
+    if (batch.len) {
+        rtv = write_full(fd, batch.data, batch.len);
+        if (rtv == 0) rtv = fdatasync(fd);
+    }
+
+    /* keep the larger buffer for the next batch */
+    pthread_mutex_lock(&j->lock);
+    if (rtv == 0) j->synced = seq;
+    if (j->pending.len == 0 && batch.cap > j->pending.cap) {
+        jbuf_free(&j->pending);
+        j->pending = batch;
+        j->pending.len = 0;
+    } else {
+        jbuf_free(&batch);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return rtv;
+}
+
+/*
+ * journal_rotate() syncs the log and goes on with the next generation.
+ * The caller must keep appends away, e.g. by holding the lock of the data.
+ */
+int journal_rotate(journal *j) {
+    if (journal_sync(j) == -1) return -1;
+
+    char *file = journal_file(j->path, ".log", j->gen + 1);
+    if (file == NULL) return -1;
+    int fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd != -1 && journal_sync_dir(file) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    free(file);
+    if (fd == -1) return -1;
+
+    pthread_mutex_lock(&j->lock);
+    close(j->fd);
+    j->fd = fd;
+    j->gen++;
+    j->size = 0;
+    pthread_mutex_unlock(&j->lock);
+    return 0;
+}
+
+/*
+ * journal_sync_dir() makes the entries of the directory holding the file
+ * path durable, e.g. a file created or renamed there.
+ */
+int journal_sync_dir(const char *path) {
+    char *dir = strdup(path);
+    if (dir == NULL) return -1;
+    int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd == -1) return -1;
+
+    int rtv = fsync(fd);
+    close(fd);
+    return rtv;
+}
+
+void journal_lock(journal *j) { pthread_mutex_lock(&j->lock); }
+
+void journal_unlock(journal *j) { pthread_mutex_unlock(&j->lock); }
+
+/*
+ * journal_detach() is for a forked child, whose appends must not reach
+ * the log of its parent.
+ */
+void journal_detach(journal *j) {
+    j->detached = 1;
+    jbuf_free(&j->pending);
+}
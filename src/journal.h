@@ -0,0 +1,67 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef SIMPLE_SERVER_JOURNAL_H
+#define SIMPLE_SERVER_JOURNAL_H
+
+/*
+ * A journal is a file of records, a record is an op and up to
+ * SSC_JOURNAL_MAX_ARGS string arguments:
+ *   u32 payload length, u32 FNV-1a of the payload,
+ *   payload: u8 op, u8 argc, then (u32 length, bytes) per argument.
+ * Integers are little endian. A record whose length or checksum doesn't
+ * match is a torn write, replay stops there and the file is truncated.
+ */
+#define SSC_JOURNAL_MAX_ARGS 8
+
+typedef struct __jbuf {
+    char *data;
+    size_t len, cap;
+} jbuf;
+
+/*
+ * journal appends records to <path>.log.<gen>. Records are buffered in
+ * pending and written with one write() and one fdatasync() by
+ * journal_sync(), so every record appended meanwhile shares the same disk
+ * flush (group commit). journal_sync() and journal_rotate() are called by a
+ * single thread, appends may come from any thread.
+ *
+ * appended counts the bytes ever appended and synced the ones on disk, a
+ * record is durable once synced reaches the count its append returned.
+ * The directory is synced whenever a log is created, so a synced record
+ * can't lose its file.
+ */
+typedef struct __journal {
+    char *path;
+    unsigned long gen;
+    int fd;
+    size_t size;  /* bytes of the current generation, pending included */
+    unsigned long long appended, synced;
+    int detached; /* appends are dropped, see journal_detach() */
+    jbuf pending;
+    pthread_mutex_t lock;
+} journal;
+
+typedef int (*journal_cb)(void *arg, int op, int argc, const char **argv);
+
+int jbuf_record(jbuf *b, int op, int argc, const char *const *argv);
+int jbuf_flush(jbuf *b, int fd);
+void jbuf_free(jbuf *b);
+
+char *journal_file(const char *path, const char *suffix, unsigned long gen);
+int journal_replay(const char *file, journal_cb cb, void *arg, size_t *size);
+
+int journal_open(journal *j, const char *path, unsigned long gen);
+size_t journal_append(journal *j, int op, int argc, const char *const *argv,
+                      unsigned long long *seq);
+size_t journal_pending(journal *j);
+unsigned long long journal_synced(journal *j);
+int journal_sync(journal *j);
+int journal_rotate(journal *j);
+int journal_sync_dir(const char *path);
+void journal_lock(journal *j);
+void journal_unlock(journal *j);
+void journal_detach(journal *j);
+
+#endif /* SIMPLE_SERVER_JOURNAL_H */
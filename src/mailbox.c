@@ -0,0 +1,70 @@
+#include "mailbox.h"
+
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+int mailbox_init(mailbox *box) {
+    atomic_store(&box->stub.next, NULL);
+    atomic_store(&box->head, &box->stub);
+    box->tail = &box->stub;
+    atomic_store(&box->signaled, 0);
+    box->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return (box->efd == -1) ? -1 : 0;
+}
+
+static void mailbox_link(mailbox *box, mailbox_node *node) {
+    atomic_store(&node->next, NULL);
+    mailbox_node *prev = atomic_exchange(&box->head, node);
+    atomic_store(&prev->next, node);
+}
+
+void mailbox_push(mailbox *box, mailbox_node *node) {
+    mailbox_link(box, node);
+
+    /* only the first push after mailbox_ack() wakes the owner up */
+    if (atomic_exchange(&box->signaled, 1) == 0) {
+        uint64_t one = 1;
+        write(box->efd, &one, sizeof(one));
+    }
+}
+
+/*
+ * mailbox_pop() returns NULL when the mailbox is empty, or when a producer
+ * is in the middle of a push. That producer signals the eventfd once it's
+ * done, so the owner is woken up again.
+ */
+mailbox_node *mailbox_pop(mailbox *box) {
+    mailbox_node *tail = box->tail;
+    mailbox_node *next = atomic_load(&tail->next);
+
+    if (tail == &box->stub) {
+        if (next == NULL) return NULL;
+        box->tail = next;
+        tail = next;
+        next = atomic_load(&tail->next);
+    }
+    if (next) {
+        box->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load(&box->head)) return NULL;
+
+    mailbox_link(box, &box->stub);
+    next = atomic_load(&tail->next);
+    if (next) {
+        box->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/*
+ * mailbox_ack() is called by the owner before draining the mailbox.
+ */
+void mailbox_ack(mailbox *box) {
+    uint64_t cnt;
+    read(box->efd, &cnt, sizeof(cnt));
+    atomic_store(&box->signaled, 0);
+}
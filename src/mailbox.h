@@ -0,0 +1,29 @@
+#include <stdatomic.h>
+
+#ifndef SIMPLE_SERVER_MAILBOX_H
+#define SIMPLE_SERVER_MAILBOX_H
+
+/*
+ * mailbox is a lock-free multi-producer single-consumer queue of intrusive
+ * nodes (Vyukov's MPSC queue). Any thread may push, only the owner pops.
+ * efd is an eventfd which becomes readable when something was pushed, so
+ * the owner can watch it in its event loop.
+ */
+typedef struct __mailbox_node {
+    _Atomic(struct __mailbox_node *) next;
+} mailbox_node;
+
+typedef struct __mailbox {
+    _Atomic(mailbox_node *) head;
+    mailbox_node *tail;
+    mailbox_node stub;
+    atomic_int signaled;
+    int efd;
+} mailbox;
+
+int mailbox_init(mailbox *box);
+void mailbox_push(mailbox *box, mailbox_node *node);
+mailbox_node *mailbox_pop(mailbox *box);
+void mailbox_ack(mailbox *box);
+
+#endif /* SIMPLE_SERVER_MAILBOX_H */
@@ -0,0 +1,1207 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "coro.h"
+#include "hashmap.h"
+#include "journal.h"
+#include "store.h"
+
+/*
+ * The memory store keeps the chatroom inside the server process, shared by
+ * the workers under mem_lock. It's kept on disk by a journal and snapshots
+ * if the store is opened with a path, and lost when the server exits
+ * otherwise.
+ *
+ * Chat builtins always run in the worker, even in a pipeline (see
+ * exec_pipeline() in server.c), a forked console never changes the store.
+ */
+
+/*
+ * mem_vec is a growable array of strings owned by the array.
+ */
+typedef struct __mem_vec {
+    char **items;
+    size_t len, cap;
+} mem_vec;
+
+typedef struct __mem_member {
+    int prior;
+    char *name;
+} mem_member;
+
+/*
+ * members is sorted by prior then by name, the first member owns the group.
+ */
+typedef struct __mem_group {
+    mem_member *members;
+    size_t len, cap;
+    char name[];
+} mem_group;
+
+/*
+ * mem_mail is a mail as a single block, items point into data.
+ */
+typedef struct __mem_mail {
+    long id;
+    const char *items[SSC_MAIL_ITEMS];
+    char data[];
+} mem_mail;
+
+/*
+ * groups keeps the groups of the user in the order they were joined, and
+ * mails is sorted by id. mail_id is the last id given to a mail. pending
+ * keeps SSC_PENDING_ITEMS items a queued message.
+ */
+typedef struct __mem_user {
+    char *passwd;
+    int online;
+    mem_vec groups;
+    mem_vec pending;
+    mem_mail **mails;
+    size_t mail_len, mail_cap;
+    long mail_id;
+    char name[];
+} mem_user;
+
+static hashmap mem_users;
+static hashmap mem_groups;
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int vec_push(mem_vec *vec, const char *str) {
+    if (vec->len == vec->cap) {
+        size_t cap = (vec->cap) ? vec->cap * 2 : 8;
+        char **items = realloc(vec->items, cap * sizeof(char *));
+        if (items == NULL) return -1;
+        vec->items = items;
+        vec->cap = cap;
+    }
+    if ((vec->items[vec->len] = strdup(str)) == NULL) return -1;
+    vec->len++;
+    return 0;
+}
+
+static void vec_erase(mem_vec *vec, size_t at, size_t n) {
+    if (n == 0) return;
+    for (size_t i = at; i < at + n; i++) free(vec->items[i]);
+    memmove(vec->items + at, vec->items + at + n,
+            (vec->len - at - n) * sizeof(char *));
+    vec->len -= n;
+}
+
+static void vec_remove(mem_vec *vec, const char *str) {
+    for (size_t i = 0; i < vec->len;) {
+        if (strcmp(vec->items[i], str) == 0) {
+            vec_erase(vec, i, 1);
+        } else {
+            i++;
+        }
+    }
+}
+
+static void vec_free(mem_vec *vec) {
+    vec_erase(vec, 0, vec->len);
+    free(vec->items);
+}
+
+static str_list *vec_list(mem_vec *vec) {
+    return str_list_new(vec->len, (const char **)vec->items);
+}
+
+static void *mem_new(hashmap *map, size_t size, const char *name) {
+    size_t len = strlen(name);
+    char *obj = calloc(1, size + len + 1);
+    if (obj == NULL) return NULL;
+
+    char *key = memcpy(obj + size, name, len + 1);
+    if (hashmap_put(map, key, obj) == -1) {
+        free(obj);
+        return NULL;
+    }
+    return obj;
+}
+
+static void mem_free_user(mem_user *user) {
+    hashmap_del(&mem_users, user->name);
+    free(user->passwd);
+    vec_free(&user->groups);
+    vec_free(&user->pending);
+    for (size_t i = 0; i < user->mail_len; i++) free(user->mails[i]);
+    free(user->mails);
+    free(user);
+}
+
+static void mem_free_group(mem_group *group) {
+    hashmap_del(&mem_groups, group->name);
+    for (size_t i = 0; i < group->len; i++) free(group->members[i].name);
+    free(group->members);
+    free(group);
+}
+
+static int member_cmp(int prior, const char *name, mem_member *m) {
+    if (prior != m->prior) return (prior < m->prior) ? -1 : 1;
+    return strcmp(name, m->name);
+}
+
+static long member_find(mem_group *group, const char *name) {
+    for (size_t i = 0; i < group->len; i++) {
+        if (strcmp(group->members[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static void member_erase(mem_group *group, size_t at) {
+    free(group->members[at].name);
+    memmove(group->members + at, group->members + at + 1,
+            (group->len - at - 1) * sizeof(mem_member));
+    group->len--;
+}
+
+/*
+ * member_insert() puts name at its place, name must not be a member.
+ */
+static int member_insert(mem_group *group, const char *name, int prior) {
+    if (group->len == group->cap) {
+        size_t cap = (group->cap) ? group->cap * 2 : 8;
+        mem_member *m = realloc(group->members, cap * sizeof(mem_member));
+        if (m == NULL) return -1;
+        group->members = m;
+        group->cap = cap;
+    }
+
+    size_t lo = 0, hi = group->len;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (member_cmp(prior, name, &group->members[mid]) < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    char *dup = strdup(name);
+    if (dup == NULL) return -1;
+    memmove(group->members + lo + 1, group->members + lo,
+            (group->len - lo) * sizeof(mem_member));
+    group->members[lo].prior = prior;
+    group->members[lo].name = dup;
+    group->len++;
+    return 0;
+}
+
+/*
+ * mem_join() adds name to group, or updates its prior. It returns 1 if
+ * name is a new member.
+ */
+static int mem_join(mem_group *group, mem_user *user, int prior) {
+    long at = member_find(group, user->name);
+    if (at != -1) {
+        member_erase(group, at);
+        return (member_insert(group, user->name, prior) == -1) ? -1 : 0;
+    }
+    if (member_insert(group, user->name, prior) == -1) return -1;
+    if (vec_push(&user->groups, group->name) == -1) {
+        member_erase(group, member_find(group, user->name));
+        return -1;
+    }
+    return 1;
+}
+
+static int mem_quit(mem_group *group, const char *name) {
+    long at = member_find(group, name);
+    if (at == -1) return 0;
+
+    member_erase(group, at);
+    mem_user *user = hashmap_get(&mem_users, name);
+    if (user) vec_remove(&user->groups, group->name);
+
+    if (at == 0 && group->len) {
+        /* the next member owns the group */
+        char *owner = strdup(group->members[0].name);
+        if (owner == NULL) return -1;
+        member_erase(group, 0);
+        member_insert(group, owner, 0);
+        free(owner);
+    }
+    return 1;
+}
+
+/*
+ * Operations of the journal, see mem_apply().
+ */
+#define MEM_OP_GEN 1 /* first record of a snapshot, the log coming next */
+#define MEM_OP_ADD_USER 2
+#define MEM_OP_PASSWD 3
+#define MEM_OP_RENAME 4
+#define MEM_OP_CREATE_GROUP 5
+#define MEM_OP_DELETE_GROUP 6
+#define MEM_OP_JOIN 7
+#define MEM_OP_QUIT 8
+#define MEM_OP_MAIL 9
+#define MEM_OP_DEL_MAIL 10
+#define MEM_OP_GROUP 11 /* empty group, written by snapshots */
+#define MEM_OP_MAIL_ID 12 /* last mail id of a user, written by snapshots */
+#define MEM_OP_QUEUE 13
+#define MEM_OP_TAKE 14
+
+/*
+ * Changes are journaled, and the journal is synced every
+ * SSC_JOURNAL_SYNC_MS, as soon as SSC_JOURNAL_BATCH bytes are pending or a
+ * job waits for its change (see mem_commit()). A job replies once its
+ * change is synced, a change made outside a job may be lost in a crash
+ * within that window. Once the log is SSC_SNAPSHOT_MIN_LOG
+ * and larger than the last snapshot, a forked child writes a new snapshot
+ * and the logs before it are removed.
+ */
+#ifndef SSC_JOURNAL_SYNC_MS
+#define SSC_JOURNAL_SYNC_MS 10
+#endif
+#ifndef SSC_JOURNAL_BATCH
+#define SSC_JOURNAL_BATCH (256 * 1024)
+#endif
+#ifndef SSC_SNAPSHOT_MIN_LOG
+#define SSC_SNAPSHOT_MIN_LOG (16 * 1024 * 1024)
+#endif
+
+static journal mem_journal;
+static int mem_durable = 0;
+static pthread_cond_t mem_flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t mem_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The flusher thread takes snapshots. mem_base_gen is the oldest log kept,
+ * mem_snap_bytes the size of the last snapshot.
+ */
+static unsigned long mem_base_gen = 1;
+static size_t mem_snap_bytes = 0;
+static pid_t mem_snap_pid = -1;
+static unsigned long mem_snap_gen = 0;
+static __thread int mem_forking = 0; /* fork() with mem_lock held */
+
+/*
+ * mem_seq is where the journal stood after the last change of the thread.
+ */
+static __thread unsigned long long mem_seq = 0;
+
+static void mem_log(int op, int argc, const char *const *argv) {
+    if (!mem_durable) return;
+    if (journal_append(&mem_journal, op, argc, argv, &mem_seq) >=
+        SSC_JOURNAL_BATCH) {
+        pthread_cond_signal(&mem_flush_cond);
+    }
+}
+
+/*
+ * mem_waiter is a job of the worker suspended until the journal is synced
+ * up to seq. The flusher wakes every worker through its eventfd after a
+ * sync, see ms_handler(). mem_wake_fds is under mem_flush_lock.
+ */
+typedef struct __mem_waiter {
+    coro *co;
+    unsigned long long seq;
+    struct __mem_waiter *next;
+} mem_waiter;
+
+static __thread mem_waiter *mem_waiters = NULL;
+static __thread int mem_wake_fd = -1;
+static int *mem_wake_fds = NULL;
+static int mem_wake_len = 0;
+static int mem_sync_wanted = 0; /* a job waits, under mem_flush_lock */
+
+/*
+ * mem_commit() is called by the store API after a change, without mem_lock.
+ * It holds the calling job, and so its reply, until the change is on disk
+ * (group commit): every job waiting meanwhile shares the same sync.
+ */
+static void mem_commit() {
+    coro *co = coro_self();
+    if (!mem_durable || mem_wake_fd == -1 || co == NULL) return;
+    if (journal_synced(&mem_journal) >= mem_seq) return;
+
+    mem_waiter waiter = {co, mem_seq, mem_waiters};
+    mem_waiters = &waiter;
+    pthread_mutex_lock(&mem_flush_lock);
+    mem_sync_wanted = 1;
+    pthread_cond_signal(&mem_flush_cond);
+    pthread_mutex_unlock(&mem_flush_lock);
+    coro_yield();
+}
+
+/*
+ * mem_wake() is called by the flusher, the workers are woken once per
+ * advance of the journal.
+ */
+static void mem_wake() {
+    static unsigned long long woken = 0;
+    unsigned long long synced = journal_synced(&mem_journal);
+    if (synced == woken) return;
+    woken = synced;
+
+    uint64_t one = 1;
+    pthread_mutex_lock(&mem_flush_lock);
+    for (int i = 0; i < mem_wake_len; i++) {
+        write(mem_wake_fds[i], &one, sizeof(one));
+    }
+    pthread_mutex_unlock(&mem_flush_lock);
+}
+
+/*
+ * The mem_* functions below change the store without locking or
+ * journaling, they are shared by the store API and the replay.
+ */
+static int mem_add_user(const char *name) {
+    if (hashmap_get(&mem_users, name)) return 0;
+    return (mem_new(&mem_users, sizeof(mem_user), name)) ? 1 : -1;
+}
+
+static int mem_set_passwd(const char *name, const char *passwd) {
+    mem_user *user = hashmap_get(&mem_users, name);
+    if (user == NULL) return -1;
+
+    char *dup = strdup(passwd);
+    if (dup == NULL) return -1;
+    free(user->passwd);
+    user->passwd = dup;
+    return 1;
+}
+
+static int mem_rename(const char *old_name, const char *new_name) {
+    if (hashmap_get(&mem_users, new_name)) return 0;
+
+    mem_user *new_user = mem_new(&mem_users, sizeof(mem_user), new_name);
+    if (new_user == NULL) return -1;
+    new_user->online = 1;
+
+    mem_user *old_user = hashmap_get(&mem_users, old_name);
+    if (old_user == NULL) return 1;
+
+    while (old_user->groups.len) {
+        mem_group *group = hashmap_get(&mem_groups, old_user->groups.items[0]);
+        if (group == NULL) {
+            vec_erase(&old_user->groups, 0, 1);
+            continue;
+        }
+        int owner = group->len && strcmp(group->members[0].name,
+                                         old_name) == 0;
+        mem_join(group, new_user, (owner) ? 0 : 10);
+        mem_quit(group, old_name);
+        vec_remove(&old_user->groups, group->name);
+    }
+    mem_free_user(old_user);
+    return 1;
+}
+
+static int mem_add_group(const char *name) {
+    if (hashmap_get(&mem_groups, name)) return 0;
+    return (mem_new(&mem_groups, sizeof(mem_group), name)) ? 1 : -1;
+}
+
+static int mem_create_group(const char *name, const char *owner) {
+    mem_user *user = hashmap_get(&mem_users, owner);
+    if (user == NULL) return -1;
+    if (hashmap_get(&mem_groups, name)) return 0;
+
+    mem_group *group = mem_new(&mem_groups, sizeof(mem_group), name);
+    return (group && mem_join(group, user, 0) == 1) ? 1 : -1;
+}
+
+static int mem_delete_group(const char *name, const char *owner) {
+    mem_group *group = hashmap_get(&mem_groups, name);
+    if (group == NULL || group->len == 0 ||
+        strcmp(group->members[0].name, owner) != 0)
+        return 0;
+
+    for (size_t i = 0; i < group->len; i++) {
+        mem_user *user = hashmap_get(&mem_users, group->members[i].name);
+        if (user) vec_remove(&user->groups, group->name);
+    }
+    mem_free_group(group);
+    return 1;
+}
+
+static int mem_join_group(const char *name, const char *member, int prior) {
+    mem_group *group = hashmap_get(&mem_groups, name);
+    mem_user *user = hashmap_get(&mem_users, member);
+    if (group == NULL || user == NULL) return -1;
+    return mem_join(group, user, prior);
+}
+
+static int mem_quit_group(const char *name, const char *member) {
+    mem_group *group = hashmap_get(&mem_groups, name);
+    return (group) ? mem_quit(group, member) : 0;
+}
+
+/*
+ * mail_find() returns the index of the first mail whose id is id or more.
+ */
+static size_t mail_find(mem_user *user, long id) {
+    size_t lo = 0, hi = user->mail_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (user->mails[mid]->id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * mem_add_mail() adds mail, the SSC_MAIL_ITEMS items of a mail whose id
+ * comes first. The id is newer than any other mail of the user, but the
+ * replay inserts the mail wherever it belongs.
+ */
+static int mem_add_mail(const char *to, const char *const *mail) {
+    mem_user *user = hashmap_get(&mem_users, to);
+    if (user == NULL) return -1;
+
+    if (user->mail_len == user->mail_cap) {
+        size_t cap = (user->mail_cap) ? user->mail_cap * 2 : 8;
+        mem_mail **mails = realloc(user->mails, cap * sizeof(mem_mail *));
+        if (mails == NULL) return -1;
+        user->mails = mails;
+        user->mail_cap = cap;
+    }
+
+    size_t size = sizeof(mem_mail);
+    for (int i = 0; i < SSC_MAIL_ITEMS; i++) size += strlen(mail[i]) + 1;
+    mem_mail *m = malloc(size);
+    if (m == NULL) return -1;
+
+    m->id = strtol(mail[0], NULL, 10);
+    char *str = m->data;
+    for (int i = 0; i < SSC_MAIL_ITEMS; i++) {
+        size_t n = strlen(mail[i]) + 1;
+        m->items[i] = memcpy(str, mail[i], n);
+        str += n;
+    }
+
+    size_t at = mail_find(user, m->id);
+    if (at < user->mail_len && user->mails[at]->id == m->id) {
+        free(m);
+        return 0;
+    }
+    memmove(user->mails + at + 1, user->mails + at,
+            (user->mail_len - at) * sizeof(mem_mail *));
+    user->mails[at] = m;
+    user->mail_len++;
+    if (m->id > user->mail_id) user->mail_id = m->id;
+    return 1;
+}
+
+static int mem_del_mail(const char *name, long id) {
+    mem_user *user = hashmap_get(&mem_users, name);
+    if (user == NULL) return 0;
+
+    size_t at = mail_find(user, id);
+    if (at == user->mail_len || user->mails[at]->id != id) return 0;
+
+    free(user->mails[at]);
+    memmove(user->mails + at, user->mails + at + 1,
+            (user->mail_len - at - 1) * sizeof(mem_mail *));
+    user->mail_len--;
+    return 1;
+}
+
+static int mem_set_mail_id(const char *name, long id) {
+    mem_user *user = hashmap_get(&mem_users, name);
+    if (user == NULL) return -1;
+    if (id > user->mail_id) user->mail_id = id;
+    return 1;
+}
+
+/*
+ * mem_queue_msg() queues msg, the SSC_PENDING_ITEMS items of a message.
+ */
+static int mem_queue_msg(const char *name, const char *const *msg) {
+    mem_user *user = hashmap_get(&mem_users, name);
+    if (user == NULL) return -1;
+
+    size_t len = user->pending.len;
+    for (int i = 0; i < SSC_PENDING_ITEMS; i++) {
+        if (vec_push(&user->pending, msg[i]) == -1) {
+            /* a message is all of its items or nothing */
+            vec_erase(&user->pending, len, user->pending.len - len);
+            return -1;
+        }
+    }
+    if (user->pending.len > SSC_PENDING_MAX * SSC_PENDING_ITEMS) {
+        vec_erase(&user->pending, 0, SSC_PENDING_ITEMS);
+    }
+    return 1;
+}
+
+static int mem_take_msgs(const char *name) {
+    mem_user *user = hashmap_get(&mem_users, name);
+    if (user == NULL || user->pending.len == 0) return 0;
+    vec_erase(&user->pending, 0, user->pending.len);
+    return 1;
+}
+
+/*
+ * mem_apply() replays a record, arg points to the generation of the log
+ * following a snapshot.
+ */
+static int mem_apply(void *arg, int op, int argc, const char **argv) {
+    static const int args[] = {
+        [MEM_OP_GEN] = 1,          [MEM_OP_ADD_USER] = 1,
+        [MEM_OP_PASSWD] = 2,       [MEM_OP_RENAME] = 2,
+        [MEM_OP_CREATE_GROUP] = 2, [MEM_OP_DELETE_GROUP] = 2,
+        [MEM_OP_JOIN] = 3,         [MEM_OP_QUIT] = 2,
+        [MEM_OP_MAIL] = 1 + SSC_MAIL_ITEMS, [MEM_OP_DEL_MAIL] = 2,
+        [MEM_OP_GROUP] = 1,        [MEM_OP_MAIL_ID] = 2,
+        [MEM_OP_QUEUE] = 1 + SSC_PENDING_ITEMS, [MEM_OP_TAKE] = 1,
+    };
+    if (op <= 0 || op > MEM_OP_TAKE || argc != args[op]) return -1;
+
+    int rtv = 0;
+    switch (op) {
+        case MEM_OP_GEN:
+            *(unsigned long *)arg = strtoul(argv[0], NULL, 10);
+            break;
+        case MEM_OP_ADD_USER:
+            rtv = mem_add_user(argv[0]);
+            break;
+        case MEM_OP_PASSWD:
+            rtv = mem_set_passwd(argv[0], argv[1]);
+            break;
+        case MEM_OP_RENAME:
+            rtv = mem_rename(argv[0], argv[1]);
+            if (rtv == 1) { /* nobody is online after a restart */
+                ((mem_user *)hashmap_get(&mem_users, argv[1]))->online = 0;
+            }
+            break;
+        case MEM_OP_CREATE_GROUP:
+            rtv = mem_create_group(argv[0], argv[1]);
+            break;
+        case MEM_OP_DELETE_GROUP:
+            rtv = mem_delete_group(argv[0], argv[1]);
+            break;
+        case MEM_OP_JOIN:
+            rtv = mem_join_group(argv[0], argv[1], atoi(argv[2]));
+            break;
+        case MEM_OP_QUIT:
+            rtv = mem_quit_group(argv[0], argv[1]);
+            break;
+        case MEM_OP_MAIL:
+            rtv = mem_add_mail(argv[0], argv + 1);
+            break;
+        case MEM_OP_DEL_MAIL:
+            rtv = mem_del_mail(argv[0], strtol(argv[1], NULL, 10));
+            break;
+        case MEM_OP_GROUP:
+            rtv = mem_add_group(argv[0]);
+            break;
+        case MEM_OP_MAIL_ID:
+            rtv = mem_set_mail_id(argv[0], strtol(argv[1], NULL, 10));
+            break;
+        case MEM_OP_QUEUE:
+            rtv = mem_queue_msg(argv[0], argv + 1);
+            break;
+        case MEM_OP_TAKE:
+            rtv = mem_take_msgs(argv[0]);
+            break;
+    }
+    return (rtv == -1) ? -1 : 0;
+}
+
+/*
+ * mem_dump() writes the whole store as the records rebuilding it, into
+ * <path>.snap. Groups come first, then every user with its password,
+ * groups in joining order and mail.
+ */
+static int mem_dump(unsigned long gen) {
+    char *tmp = journal_file(mem_journal.path, ".snap.tmp", 0);
+    char *snap = journal_file(mem_journal.path, ".snap", 0);
+    if (tmp == NULL || snap == NULL) return -1;
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+
+    jbuf b = {0};
+    int err = 0;
+    char num[24];
+    snprintf(num, sizeof(num), "%lu", gen);
+    const char *arg[1 + SSC_MAIL_ITEMS] = {num};
+    err |= jbuf_record(&b, MEM_OP_GEN, 1, arg) == -1;
+
+    size_t iter = 0;
+    for (hashmap_entry *e; (e = hashmap_next(&mem_groups, &iter));) {
+        arg[0] = e->key;
+        err |= jbuf_record(&b, MEM_OP_GROUP, 1, arg) == -1;
+    }
+
+    iter = 0;
+    for (hashmap_entry *e; !err && (e = hashmap_next(&mem_users, &iter));) {
+        mem_user *user = e->value;
+        arg[0] = user->name;
+        err |= jbuf_record(&b, MEM_OP_ADD_USER, 1, arg) == -1;
+        if (user->passwd) {
+            arg[1] = user->passwd;
+            err |= jbuf_record(&b, MEM_OP_PASSWD, 2, arg) == -1;
+        }
+        for (size_t i = 0; i < user->groups.len; i++) {
+            mem_group *group = hashmap_get(&mem_groups, user->groups.items[i]);
+            long at = (group) ? member_find(group, user->name) : -1;
+            if (at == -1) continue;
+
+            snprintf(num, sizeof(num), "%d", group->members[at].prior);
+            const char *join[3] = {group->name, user->name, num};
+            err |= jbuf_record(&b, MEM_OP_JOIN, 3, join) == -1;
+        }
+        for (size_t i = 0; i < user->mail_len; i++) {
+            memcpy(arg + 1, user->mails[i]->items,
+                   SSC_MAIL_ITEMS * sizeof(char *));
+            err |= jbuf_record(&b, MEM_OP_MAIL, 1 + SSC_MAIL_ITEMS,
+                               arg) == -1;
+        }
+        if (user->mail_id) {
+            snprintf(num, sizeof(num), "%ld", user->mail_id);
+            arg[1] = num;
+            err |= jbuf_record(&b, MEM_OP_MAIL_ID, 2, arg) == -1;
+        }
+        for (size_t i = 0; i + SSC_PENDING_ITEMS <= user->pending.len;
+             i += SSC_PENDING_ITEMS) {
+            memcpy(arg + 1, user->pending.items + i,
+                   SSC_PENDING_ITEMS * sizeof(char *));
+            err |= jbuf_record(&b, MEM_OP_QUEUE, 1 + SSC_PENDING_ITEMS,
+                               arg) == -1;
+        }
+        if (b.len >= SSC_JOURNAL_BATCH) err |= jbuf_flush(&b, fd) == -1;
+    }
+
+    if (err || jbuf_flush(&b, fd) == -1 || fsync(fd) == -1 || close(fd) == -1)
+        return -1;
+    /* the older logs are removed once the rename is durable */
+    if (rename(tmp, snap) == -1) return -1;
+    return journal_sync_dir(snap);
+}
+
+/*
+ * mem_snapshot() starts the next log and forks the child writing the
+ * snapshot, the copy-on-write memory of the child is a consistent image of
+ * the store at the point the log was switched. The log is synced before
+ * the workers are locked out, the sync of the switch only covers the
+ * records appended meanwhile.
+ */
+static void mem_snapshot() {
+    if (journal_sync(&mem_journal) == -1) {
+        perror("journal_sync()");
+        return;
+    }
+
+    pthread_mutex_lock(&mem_lock);
+    if (journal_rotate(&mem_journal) == -1) {
+        pthread_mutex_unlock(&mem_lock);
+        perror("journal_rotate()");
+        return;
+    }
+    unsigned long gen = mem_journal.gen;
+
+    mem_forking = 1;
+    pid_t pid = fork();
+    if (pid == 0) _exit((mem_dump(gen) == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+    mem_forking = 0;
+    pthread_mutex_unlock(&mem_lock);
+
+    if (pid == -1) {
+        perror("fork()");
+        return;
+    }
+    mem_snap_pid = pid;
+    mem_snap_gen = gen;
+}
+
+static void mem_snapshot_done(int status) {
+    mem_snap_pid = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "snapshot of %s failed\n", mem_journal.path);
+        return;
+    }
+
+    char *snap = journal_file(mem_journal.path, ".snap", 0);
+    struct stat st;
+    if (snap && stat(snap, &st) == 0) mem_snap_bytes = st.st_size;
+    free(snap);
+
+    for (; mem_base_gen < mem_snap_gen; mem_base_gen++) {
+        char *file = journal_file(mem_journal.path, ".log", mem_base_gen);
+        if (file) unlink(file);
+        free(file);
+    }
+}
+
+static void *mem_flush_main(void *arg) {
+    while (1) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += SSC_JOURNAL_SYNC_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+
+        pthread_mutex_lock(&mem_flush_lock);
+        if (!mem_sync_wanted &&
+            journal_pending(&mem_journal) < SSC_JOURNAL_BATCH) {
+            pthread_cond_timedwait(&mem_flush_cond, &mem_flush_lock, &ts);
+        }
+        mem_sync_wanted = 0;
+        pthread_mutex_unlock(&mem_flush_lock);
+
+        if (journal_sync(&mem_journal) == -1) {
+            perror("journal_sync()");
+            exit(EXIT_FAILURE);
+        }
+        mem_wake();
+
+        if (mem_snap_pid != -1) {
+            int status;
+            if (waitpid(mem_snap_pid, &status, WNOHANG) == mem_snap_pid) {
+                mem_snapshot_done(status);
+            }
+        } else if (mem_journal.size >= SSC_SNAPSHOT_MIN_LOG &&
+                   mem_journal.size >= mem_snap_bytes) {
+            mem_snapshot();
+            mem_wake();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * A fork() while another thread holds mem_lock or the journal would leave
+ * the child with a lock nobody releases, so forking waits for both. The
+ * child doesn't write to the journal of its parent.
+ */
+static void mem_prepare() {
+    if (!mem_forking) pthread_mutex_lock(&mem_lock);
+    if (mem_durable) journal_lock(&mem_journal);
+}
+
+static void mem_parent() {
+    if (mem_durable) journal_unlock(&mem_journal);
+    if (!mem_forking) pthread_mutex_unlock(&mem_lock);
+}
+
+static void mem_child() {
+    if (mem_durable) {
+        journal_detach(&mem_journal);
+        journal_unlock(&mem_journal);
+        mem_durable = 0;
+    }
+    if (!mem_forking) pthread_mutex_unlock(&mem_lock);
+}
+
+static void mem_atfork() { pthread_atfork(mem_prepare, mem_parent, mem_child); }
+
+/*
+ * ms_open() loads <path>.snap and the logs after it, then journals every
+ * change to <path>.log.<gen>. Without path the store is volatile.
+ */
+static int ms_open(const char *path) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, mem_atfork);
+    if (path == NULL) return 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    unsigned long gen = 1;
+    char *file = journal_file(path, ".snap", 0);
+    if (file == NULL) return -1;
+    int rtv = journal_replay(file, mem_apply, &gen, &mem_snap_bytes);
+    free(file);
+    if (rtv == -1) return -1;
+
+    /* the logs of the crashed snapshots */
+    for (unsigned long g = gen - 1; g > 0; g--) {
+        if ((file = journal_file(path, ".log", g)) == NULL) return -1;
+        rtv = unlink(file);
+        free(file);
+        if (rtv == -1) break;
+    }
+
+    /* a crash while a snapshot was written leaves more than one log */
+    mem_base_gen = gen;
+    for (unsigned long g = gen;; g++) {
+        if ((file = journal_file(path, ".log", g)) == NULL) return -1;
+        if (access(file, F_OK) == -1) {
+            free(file);
+            break;
+        }
+        size_t size;
+        rtv = journal_replay(file, mem_apply, &gen, &size);
+        free(file);
+        if (rtv == -1) return -1;
+        gen = g;
+    }
+
+    if (journal_open(&mem_journal, path, gen) == -1) return -1;
+    mem_durable = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("store %s: %zu users, %zu groups loaded in %.3fs\n", path,
+           mem_users.len, mem_groups.len,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    pthread_t flusher;
+    if (pthread_create(&flusher, NULL, mem_flush_main, NULL) != 0) return -1;
+    pthread_detach(flusher);
+    return 0;
+}
+
+/*
+ * ms_init() gives a worker of a store kept on disk the eventfd which
+ * resumes its jobs waiting in mem_commit().
+ */
+static int ms_init() {
+    if (!mem_durable) return 0;
+
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd == -1) return -1;
+    int fd[2] = {efd, efd};
+    pfd_element *pfd = add_pfd(fd, SSC_STORE);
+    if (pfd == NULL) {
+        close(efd);
+        return -1;
+    }
+    if (watch_pfd(pfd, EPOLLIN) == -1) {
+        close_pfd(pfd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mem_flush_lock);
+    int *fds = realloc(mem_wake_fds, (mem_wake_len + 1) * sizeof(int));
+    if (fds) {
+        fds[mem_wake_len++] = efd;
+        mem_wake_fds = fds;
+    }
+    pthread_mutex_unlock(&mem_flush_lock);
+    if (fds == NULL) return -1;
+    mem_wake_fd = efd;
+    return 0;
+}
+
+/*
+ * ms_handler() resumes the jobs whose change is on disk. The list is taken
+ * first, a resumed job may wait again.
+ */
+static void ms_handler(pfd_element *pfd) {
+    uint64_t count;
+    if (read(pfd->read, &count, sizeof(count)) == -1) return;
+
+    unsigned long long synced = journal_synced(&mem_journal);
+    mem_waiter *waiter = mem_waiters;
+    mem_waiters = NULL;
+    while (waiter) {
+        /* the waiter lives on the stack of its job */
+        mem_waiter *next = waiter->next;
+        if (waiter->seq <= synced) {
+            coro_resume(waiter->co);
+        } else {
+            waiter->next = mem_waiters;
+            mem_waiters = waiter;
+        }
+        waiter = next;
+    }
+}
+
+static int ms_user_exists(const char *name) {
+    pthread_mutex_lock(&mem_lock);
+    int rtv = hashmap_get(&mem_users, name) != NULL;
+    pthread_mutex_unlock(&mem_lock);
+    return rtv;
+}
+
+static int ms_add_user(const char *name) {
+    pthread_mutex_lock(&mem_lock);
+    int rtv = mem_add_user(name);
+    if (rtv == 1) mem_log(MEM_OP_ADD_USER, 1, &name);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return (rtv == -1) ? -1 : 0;
+}
+
+static int ms_check_passwd(const char *name, const char *passwd) {
+    int rtv = -1;
+    pthread_mutex_lock(&mem_lock);
+    mem_user *user = hashmap_get(&mem_users, name);
+    if (user && user->passwd) {
+        rtv = strcmp(user->passwd, passwd) == 0;
+    } else if (user) {
+        rtv = mem_set_passwd(name, passwd);
+        const char *arg[2] = {name, passwd};
+        if (rtv == 1) mem_log(MEM_OP_PASSWD, 2, arg);
+    }
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return rtv;
+}
+
+static void ms_set_online(const char *name, int online) {
+    pthread_mutex_lock(&mem_lock);
+    mem_user *user = hashmap_get(&mem_users, name);
+    if (user) user->online = online;
+    pthread_mutex_unlock(&mem_lock);
+}
+
+static int ms_is_online(const char *name) {
+    pthread_mutex_lock(&mem_lock);
+    mem_user *user = hashmap_get(&mem_users, name);
+    int rtv = user && user->online;
+    pthread_mutex_unlock(&mem_lock);
+    return rtv;
+}
+
+static str_list *ms_offline_users() {
+    pthread_mutex_lock(&mem_lock);
+    const char **names = malloc((mem_users.len + 1) * sizeof(char *));
+    str_list *list = NULL;
+    if (names) {
+        size_t iter = 0, len = 0;
+        for (hashmap_entry *e; (e = hashmap_next(&mem_users, &iter));) {
+            mem_user *user = e->value;
+            if (!user->online) names[len++] = user->name;
+        }
+        list = str_list_new(len, names);
+        free(names);
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return list;
+}
+
+static int ms_rename_user(const char *old_name, const char *new_name) {
+    pthread_mutex_lock(&mem_lock);
+    int rtv = mem_rename(old_name, new_name);
+    const char *arg[2] = {old_name, new_name};
+    if (rtv == 1) mem_log(MEM_OP_RENAME, 2, arg);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return rtv;
+}
+
+static int ms_group_exists(const char *group) {
+    pthread_mutex_lock(&mem_lock);
+    int rtv = hashmap_get(&mem_groups, group) != NULL;
+    pthread_mutex_unlock(&mem_lock);
+    return rtv;
+}
+
+static str_list *ms_groups() {
+    pthread_mutex_lock(&mem_lock);
+    const char **names = malloc((mem_groups.len + 1) * sizeof(char *));
+    str_list *list = NULL;
+    if (names) {
+        size_t iter = 0, len = 0;
+        for (hashmap_entry *e; (e = hashmap_next(&mem_groups, &iter));) {
+            names[len++] = e->key;
+        }
+        list = str_list_new(len, names);
+        free(names);
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return list;
+}
+
+static str_list *ms_groups_of(const char *name) {
+    pthread_mutex_lock(&mem_lock);
+    mem_user *user = hashmap_get(&mem_users, name);
+    str_list *list = (user) ? vec_list(&user->groups) : str_list_new(0, NULL);
+    pthread_mutex_unlock(&mem_lock);
+    return list;
+}
+
+static str_list *ms_members(const char *name) {
+    pthread_mutex_lock(&mem_lock);
+    mem_group *group = hashmap_get(&mem_groups, name);
+    size_t len = (group) ? group->len : 0;
+    const char **names = malloc((len + 1) * sizeof(char *));
+    str_list *list = NULL;
+    if (names) {
+        for (size_t i = 0; i < len; i++) names[i] = group->members[i].name;
+        list = str_list_new(len, names);
+        free(names);
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return list;
+}
+
+static int ms_create_group(const char *name, const char *owner) {
+    pthread_mutex_lock(&mem_lock);
+    int rtv = mem_create_group(name, owner);
+    const char *arg[2] = {name, owner};
+    if (rtv == 1) mem_log(MEM_OP_CREATE_GROUP, 2, arg);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return rtv;
+}
+
+static int ms_delete_group(const char *name, const char *owner) {
+    pthread_mutex_lock(&mem_lock);
+    int rtv = mem_delete_group(name, owner);
+    const char *arg[2] = {name, owner};
+    if (rtv == 1) mem_log(MEM_OP_DELETE_GROUP, 2, arg);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return rtv;
+}
+
+static int ms_join_group(const char *name, const char *member, int prior) {
+    pthread_mutex_lock(&mem_lock);
+    int rtv = mem_join_group(name, member, prior);
+    char num[16];
+    snprintf(num, sizeof(num), "%d", prior);
+    const char *arg[3] = {name, member, num};
+    if (rtv != -1) mem_log(MEM_OP_JOIN, 3, arg);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return rtv;
+}
+
+static int ms_quit_group(const char *name, const char *member) {
+    pthread_mutex_lock(&mem_lock);
+    int rtv = mem_quit_group(name, member);
+    const char *arg[2] = {name, member};
+    if (rtv == 1) mem_log(MEM_OP_QUIT, 2, arg);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return rtv;
+}
+
+static str_list *ms_mails(const char *name, long offset, long count) {
+    pthread_mutex_lock(&mem_lock);
+    mem_user *user = hashmap_get(&mem_users, name);
+    size_t len = (user) ? user->mail_len : 0;
+    size_t first = (offset < 0 || (size_t)offset > len) ? len : offset;
+    if (count >= 0 && (size_t)count < len - first) len = first + count;
+
+    str_list *list = NULL;
+    const char **items =
+        malloc(((len - first) * SSC_MAIL_ITEMS + 1) * sizeof(char *));
+    if (items) {
+        for (size_t i = first; i < len; i++) {
+            memcpy(items + (i - first) * SSC_MAIL_ITEMS, user->mails[i]->items,
+                   SSC_MAIL_ITEMS * sizeof(char *));
+        }
+        list = str_list_new((len - first) * SSC_MAIL_ITEMS, items);
+        free(items);
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return list;
+}
+
+static long ms_mail_count(const char *name) {
+    pthread_mutex_lock(&mem_lock);
+    mem_user *user = hashmap_get(&mem_users, name);
+    long rtv = (user) ? (long)user->mail_len : 0;
+    pthread_mutex_unlock(&mem_lock);
+    return rtv;
+}
+
+static int ms_send_mail(const char *to, const char *from, const char *msg) {
+    char date[16], time[16], id[24];
+    if (mail_stamp(date, sizeof(date), time, sizeof(time)) == -1) return -1;
+
+    const char *arg[1 + SSC_MAIL_ITEMS] = {to, id, date, time, from, msg};
+    int rtv = -1;
+    pthread_mutex_lock(&mem_lock);
+    mem_user *user = hashmap_get(&mem_users, to);
+    if (user) {
+        snprintf(id, sizeof(id), "%ld", user->mail_id + 1);
+        rtv = mem_add_mail(to, arg + 1);
+    }
+    if (rtv == 1) mem_log(MEM_OP_MAIL, 1 + SSC_MAIL_ITEMS, arg);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return (rtv == -1) ? -1 : 0;
+}
+
+static int ms_delete_mail(const char *name, long id) {
+    char num[24];
+    snprintf(num, sizeof(num), "%ld", id);
+    const char *arg[2] = {name, num};
+
+    pthread_mutex_lock(&mem_lock);
+    int rtv = mem_del_mail(name, id);
+    if (rtv == 1) mem_log(MEM_OP_DEL_MAIL, 2, arg);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return rtv;
+}
+
+static int ms_queue_msg(const char *name, const char *from, const char *msg) {
+    char now[24];
+    snprintf(now, sizeof(now), "%ld", (long)time(NULL));
+    const char *arg[1 + SSC_PENDING_ITEMS] = {name, now, from, msg};
+
+    pthread_mutex_lock(&mem_lock);
+    int rtv = mem_queue_msg(name, arg + 1);
+    if (rtv == 1) mem_log(MEM_OP_QUEUE, 1 + SSC_PENDING_ITEMS, arg);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return (rtv == -1) ? -1 : 0;
+}
+
+static str_list *ms_take_msgs(const char *name) {
+    long since = (long)time(NULL) - SSC_PENDING_TTL;
+    str_list *list = NULL;
+
+    pthread_mutex_lock(&mem_lock);
+    mem_user *user = hashmap_get(&mem_users, name);
+    mem_vec *pending = (user) ? &user->pending : NULL;
+    size_t len = (pending) ? pending->len : 0;
+    const char **items = malloc((len + 1) * sizeof(char *));
+    if (items) {
+        size_t live = 0;
+        for (size_t i = 0; i + SSC_PENDING_ITEMS <= len;
+             i += SSC_PENDING_ITEMS) {
+            if (strtol(pending->items[i], NULL, 10) < since) continue;
+            memcpy(items + live, pending->items + i,
+                   SSC_PENDING_ITEMS * sizeof(char *));
+            live += SSC_PENDING_ITEMS;
+        }
+        list = str_list_new(live, items);
+        free(items);
+    }
+    if (list && mem_take_msgs(name) == 1) mem_log(MEM_OP_TAKE, 1, &name);
+    pthread_mutex_unlock(&mem_lock);
+    mem_commit();
+    return list;
+}
+
+const store memory_store = {
+    .name = "memory",
+    .open = ms_open,
+    .init = ms_init,
+    .user_exists = ms_user_exists,
+    .add_user = ms_add_user,
+    .check_passwd = ms_check_passwd,
+    .set_online = ms_set_online,
+    .is_online = ms_is_online,
+    .offline_users = ms_offline_users,
+    .rename_user = ms_rename_user,
+    .group_exists = ms_group_exists,
+    .groups = ms_groups,
+    .groups_of = ms_groups_of,
+    .members = ms_members,
+    .create_group = ms_create_group,
+    .delete_group = ms_delete_group,
+    .join_group = ms_join_group,
+    .quit_group = ms_quit_group,
+    .mails = ms_mails,
+    .mail_count = ms_mail_count,
+    .send_mail = ms_send_mail,
+    .delete_mail = ms_delete_mail,
+    .queue_msg = ms_queue_msg,
+    .take_msgs = ms_take_msgs,
+    .handler = ms_handler,
+};
@@ -0,0 +1,234 @@
+#include "outq.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "stats.h"
+
+#define OUTQ_SEG_SIZE 1024 /* minimum size of a segment */
+#define OUTQ_MAX_IOV 64    /* segments sent by one writev() */
+#define OUTBUF_SMALL 512   /* capacity of a recycled out_buf */
+#define OUTBUF_MAX_FREE 64 /* small out_buf kept by a thread */
+
+static __thread out_buf *outbuf_free_list = NULL;
+static __thread int outbuf_free_len = 0;
+
+/*
+ * outbuf_printf() returns a new buffer with a reference owned by the
+ * caller, or NULL if it fails.
+ */
+out_buf *outbuf_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0) return NULL;
+
+    out_buf *buf = NULL;
+    if (len < OUTBUF_SMALL && (buf = outbuf_free_list)) {
+        outbuf_free_list = buf->next_free;
+        outbuf_free_len--;
+    } else {
+        size_t cap = (len < OUTBUF_SMALL) ? OUTBUF_SMALL : len + 1;
+        if ((buf = malloc(sizeof(out_buf) + cap)) == NULL) return NULL;
+        buf->cap = cap;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(buf->data, len + 1, fmt, ap);
+    va_end(ap);
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    return buf;
+}
+
+out_buf *outbuf_ref(out_buf *buf) {
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    return buf;
+}
+
+void outbuf_unref(out_buf *buf) {
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    if (buf->cap == OUTBUF_SMALL && outbuf_free_len < OUTBUF_MAX_FREE) {
+        buf->next_free = outbuf_free_list;
+        outbuf_free_list = buf;
+        outbuf_free_len++;
+    } else {
+        free(buf);
+    }
+}
+
+static void outq_release(out_queue *q, out_seg *seg) {
+    if (seg->shared) {
+        outbuf_unref(seg->shared);
+    } else if (q->spare == NULL && seg->size == OUTQ_SEG_SIZE) {
+        q->spare = seg->data;
+        q->spare_size = seg->size;
+    } else {
+        free(seg->data);
+    }
+}
+
+static out_seg *outq_tail(out_queue *q) {
+    if (q->count == 0) return NULL;
+    return &q->segs[(q->head + q->count - 1) % q->cap];
+}
+
+/*
+ * outq_push() pushes an empty segment into the ring.
+ */
+static out_seg *outq_push(out_queue *q) {
+    if (q->count == q->cap) {
+        int cap = (q->cap) ? q->cap * 2 : 8;
+        out_seg *segs = malloc(cap * sizeof(out_seg));
+        if (segs == NULL) return NULL;
+        for (int i = 0; i < q->count; i++) {
+            segs[i] = q->segs[(q->head + i) % q->cap];
+        }
+        free(q->segs);
+        q->segs = segs;
+        q->cap = cap;
+        q->head = 0;
+    }
+
+    out_seg *tail = &q->segs[(q->head + q->count) % q->cap];
+    memset(tail, 0, sizeof(out_seg));
+    q->count++;
+    return tail;
+}
+
+/*
+ * outq_reserve() returns a segment with at least len bytes free at the end,
+ * a new segment is pushed into the ring if the tail is full or shared.
+ */
+static out_seg *outq_reserve(out_queue *q, size_t len) {
+    out_seg *tail = outq_tail(q);
+    if (tail && !tail->shared && tail->size - tail->len >= len) return tail;
+
+    size_t size = (len > OUTQ_SEG_SIZE) ? len : OUTQ_SEG_SIZE;
+    char *data;
+    if (q->spare && q->spare_size >= size) {
+        data = q->spare;
+        size = q->spare_size;
+        q->spare = NULL;
+    } else if ((data = malloc(size)) == NULL) {
+        return NULL;
+    }
+
+    if ((tail = outq_push(q)) == NULL) {
+        free(data);
+        return NULL;
+    }
+    tail->data = data;
+    tail->size = size;
+    return tail;
+}
+
+int outq_append(out_queue *q, const char *buf, size_t len) {
+    if (len == 0) return 0;
+
+    out_seg *seg = outq_reserve(q, len);
+    if (seg == NULL) return -1;
+
+    memcpy(seg->data + seg->len, buf, len);
+    seg->len += len;
+    q->bytes += len;
+    return 0;
+}
+
+/*
+ * outq_append_buf() queues buf without copying it, the queue takes a
+ * reference of its own.
+ */
+int outq_append_buf(out_queue *q, out_buf *buf) {
+    if (buf->len == 0) return 0;
+
+    out_seg *seg = outq_push(q);
+    if (seg == NULL) return -1;
+
+    seg->data = buf->data;
+    seg->shared = outbuf_ref(buf);
+    seg->size = seg->len = buf->len;
+    q->bytes += buf->len;
+    return 0;
+}
+
+int outq_vprintf(out_queue *q, const char *fmt, va_list ap) {
+    char buf[1024];
+    va_list cp;
+    va_copy(cp, ap);
+    int len = vsnprintf(buf, sizeof(buf), fmt, cp);
+    va_end(cp);
+    if (len < 0) return -1;
+    if (len < sizeof(buf)) return outq_append(q, buf, len);
+
+    out_seg *seg = outq_reserve(q, len + 1);
+    if (seg == NULL) return -1;
+    vsnprintf(seg->data + seg->len, len + 1, fmt, ap);
+    seg->len += len;
+    q->bytes += len;
+    return 0;
+}
+
+/*
+ * outq_flush() sends as much as the socket takes, it returns the bytes still
+ * queued or -1 if the connection is broken. sendmsg() is writev() without
+ * raising SIGPIPE on a closed connection.
+ */
+ssize_t outq_flush(out_queue *q, int fd) {
+    while (q->count) {
+        struct iovec iov[OUTQ_MAX_IOV];
+        int n = 0;
+        for (; n < q->count && n < OUTQ_MAX_IOV; n++) {
+            out_seg *seg = &q->segs[(q->head + n) % q->cap];
+            iov[n].iov_base = seg->data + seg->off;
+            iov[n].iov_len = seg->len - seg->off;
+        }
+
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        q->bytes -= sent;
+        stats_add(STAT_BYTES_OUT, sent);
+
+        /* pop the segments which are sent completely */
+        while (q->count) {
+            out_seg *seg = &q->segs[q->head];
+            size_t left = seg->len - seg->off;
+            if ((size_t)sent < left) {
+                seg->off += sent;
+                break;
+            }
+            sent -= left;
+            if (q->count == 1 && !seg->shared) {
+                /* keep the last segment for the next writes */
+                seg->off = seg->len = 0;
+                if (sent == 0) return q->bytes;
+            }
+            outq_release(q, seg);
+            q->head = (q->head + 1) % q->cap;
+            q->count--;
+        }
+    }
+    return q->bytes;
+}
+
+void outq_free(out_queue *q) {
+    for (int i = 0; i < q->count; i++) {
+        outq_release(q, &q->segs[(q->head + i) % q->cap]);
+    }
+    free(q->segs);
+    free(q->spare);
+    memset(q, 0, sizeof(out_queue));
+}
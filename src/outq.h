@@ -0,0 +1,59 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef SIMPLE_SERVER_OUTQ_H
+#define SIMPLE_SERVER_OUTQ_H
+
+/*
+ * out_buf is a reference-counted buffer, queued as it is by every
+ * connection it's sent to, so a broadcast is formatted and allocated once.
+ * The count is atomic, workers may share a buffer. Small buffers are
+ * recycled by the thread dropping the last reference.
+ */
+typedef struct __out_buf {
+    atomic_int refs;
+    size_t len, cap;
+    struct __out_buf *next_free;
+    char data[];
+} out_buf;
+
+/*
+ * out_queue is the pending output of a connection. It's a ring of segments,
+ * small writes are packed into the last segment and the whole ring is sent
+ * with a single vectored write when the socket is writable. A segment of
+ * shared data is an out_buf, which is never written into.
+ */
+typedef struct __out_seg {
+    char *data;
+    out_buf *shared; /* the owner of data if shared, NULL otherwise */
+    size_t size;     /* allocated size of data */
+    size_t off;      /* bytes already sent */
+    size_t len;      /* bytes filled */
+} out_seg;
+
+/*
+ * spare is the data of a private segment of the default size which was
+ * sent, kept for the next one so a connection in steady state doesn't
+ * allocate.
+ */
+typedef struct __out_queue {
+    out_seg *segs;
+    int cap, head, count;
+    size_t bytes; /* bytes waiting to be sent */
+    char *spare;
+    size_t spare_size;
+} out_queue;
+
+out_buf *outbuf_printf(const char *fmt, ...);
+out_buf *outbuf_ref(out_buf *buf);
+void outbuf_unref(out_buf *buf);
+
+int outq_append(out_queue *q, const char *buf, size_t len);
+int outq_append_buf(out_queue *q, out_buf *buf);
+int outq_vprintf(out_queue *q, const char *fmt, va_list ap);
+ssize_t outq_flush(out_queue *q, int fd);
+void outq_free(out_queue *q);
+
+#endif /* SIMPLE_SERVER_OUTQ_H */
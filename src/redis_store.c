@@ -0,0 +1,502 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bus.h"
+#include "cache.h"
+#include "db.h"
+#include "store.h"
+
+/*
+ * The redis store keeps:
+ *   Chatroom            set of users
+ *   Chatroom.nodes      set of the nodes (see bus_node()) sending heartbeats
+ *   Chatroom.node.<id>  set while the node is alive, expires without them
+ *   Chatroom.online.<id>
+ *                       set of the users logged in on the node, expires
+ *                       along with it
+ *   Chatroom.group      set of groups
+ *   <name>              password of the user
+ *   <name>.group        list of the groups of the user
+ *   <name>.inbox        sorted set of the mail of the user, scored by id
+ *   <name>.inbox.id     last mail id given to the user
+ *   <name>.pending      list of the messages queued for the user
+ *   <group>             sorted set of the members of the group
+ * Operations touching several keys are a script, so they take one round
+ * trip and are atomic.
+ */
+
+/*
+ * SSC_LUA_RENAME moves ARGV[1] to the name ARGV[2], logged in on the node
+ * whose users are the set ARGV[3]. The owner of a group stays the owner.
+ * It returns the groups of the user, or -1 if ARGV[2] is taken.
+ */
+#define SSC_LUA_RENAME                                                    \
+    "local old, new = ARGV[1], ARGV[2]\n"                                 \
+    "if redis.call('SADD', 'Chatroom', new) == 0 then return -1 end\n"    \
+    "local gps = redis.call('LRANGE', old .. '.group', 0, -1)\n"          \
+    "for _, gp in ipairs(gps) do\n"                                       \
+    "  local owner = redis.call('ZRANGE', gp, 0, 0)[1]\n"                 \
+    "  local prior = (owner == old) and 0 or 10\n"                        \
+    "  if redis.call('ZADD', gp, prior, new) == 1 then\n"                 \
+    "    redis.call('RPUSH', new .. '.group', gp)\n"                      \
+    "  end\n"                                                             \
+    "  redis.call('ZREM', gp, old)\n"                                     \
+    "end\n"                                                               \
+    "redis.call('SADD', ARGV[3], new)\n"                                  \
+    "redis.call('SREM', ARGV[3], old)\n"                                  \
+    "redis.call('SREM', 'Chatroom', old)\n"                               \
+    "redis.call('DEL', old, old .. '.group', old .. '.inbox',\n"          \
+    "           old .. '.inbox.id', old .. '.pending')\n"                  \
+    "return gps\n"
+
+/*
+ * SSC_LUA_LIVE_NODES puts the user sets of the nodes which are alive in
+ * online, and forgets the nodes which are gone.
+ */
+#define SSC_LUA_LIVE_NODES                                                \
+    "local online = {}\n"                                                 \
+    "local nodes = redis.call('SMEMBERS', 'Chatroom.nodes')\n"            \
+    "for _, node in ipairs(nodes) do\n"                                   \
+    "  if redis.call('EXISTS', 'Chatroom.node.' .. node) == 1 then\n"     \
+    "    table.insert(online, 'Chatroom.online.' .. node)\n"              \
+    "  else\n"                                                            \
+    "    redis.call('SREM', 'Chatroom.nodes', node)\n"                    \
+    "    redis.call('DEL', 'Chatroom.online.' .. node)\n"                 \
+    "  end\n"                                                             \
+    "end\n"
+
+/*
+ * SSC_LUA_ISONLINE returns 1 if ARGV[1] is logged in on a node which is
+ * alive.
+ */
+#define SSC_LUA_ISONLINE                                                  \
+    SSC_LUA_LIVE_NODES                                                    \
+    "for _, key in ipairs(online) do\n"                                   \
+    "  if redis.call('SISMEMBER', key, ARGV[1]) == 1 then return 1 end\n" \
+    "end\n"                                                               \
+    "return 0\n"
+
+/*
+ * SSC_LUA_OFFLINE returns the users who aren't logged in on a node which
+ * is alive.
+ */
+#define SSC_LUA_OFFLINE                                                   \
+    SSC_LUA_LIVE_NODES                                                    \
+    "if #online == 0 then\n"                                              \
+    "  return redis.call('SMEMBERS', 'Chatroom')\n"                       \
+    "end\n"                                                               \
+    "return redis.call('SDIFF', 'Chatroom', unpack(online))\n"
+
+/*
+ * SSC_LUA_CREATEGROUP creates the group KEYS[1] owned by ARGV[1], it
+ * returns 0 if the group exists.
+ */
+#define SSC_LUA_CREATEGROUP                                               \
+    "if redis.call('SADD', 'Chatroom.group', KEYS[1]) == 0 then\n"        \
+    "  return 0\n"                                                        \
+    "end\n"                                                               \
+    "redis.call('ZADD', KEYS[1], 0, ARGV[1])\n"                           \
+    "redis.call('RPUSH', ARGV[1] .. '.group', KEYS[1])\n"                 \
+    "return 1\n"
+
+/*
+ * SSC_LUA_DELGROUP deletes the group KEYS[1] and removes it from the group
+ * list of every member, if ARGV[1] owns it. It returns 0 otherwise.
+ */
+#define SSC_LUA_DELGROUP                                                  \
+    "if redis.call('ZRANGE', KEYS[1], 0, 0)[1] ~= ARGV[1] then\n"         \
+    "  return 0\n"                                                        \
+    "end\n"                                                               \
+    "redis.call('SREM', 'Chatroom.group', KEYS[1])\n"                     \
+    "for _, user in ipairs(redis.call('ZRANGE', KEYS[1], 0, -1)) do\n"    \
+    "  redis.call('LREM', user .. '.group', 0, KEYS[1])\n"                \
+    "end\n"                                                               \
+    "redis.call('DEL', KEYS[1])\n"                                        \
+    "return 1\n"
+
+/*
+ * SSC_LUA_JOINGROUP adds ARGV[1] to KEYS[1] with the prior ARGV[2], it
+ * returns 0 if ARGV[1] is a member already.
+ */
+#define SSC_LUA_JOINGROUP                                                 \
+    "if redis.call('ZADD', KEYS[1], ARGV[2], ARGV[1]) == 0 then\n"        \
+    "  return 0\n"                                                        \
+    "end\n"                                                               \
+    "redis.call('RPUSH', ARGV[1] .. '.group', KEYS[1])\n"                 \
+    "return 1\n"
+
+/*
+ * SSC_LUA_QUITGROUP removes ARGV[1] from KEYS[1], the next member owns the
+ * group if ARGV[1] did. It returns 0 if ARGV[1] isn't a member.
+ */
+#define SSC_LUA_QUITGROUP                                                 \
+    "local owner = redis.call('ZRANGE', KEYS[1], 0, 1)\n"                 \
+    "if redis.call('ZREM', KEYS[1], ARGV[1]) == 0 then return 0 end\n"    \
+    "redis.call('LREM', ARGV[1] .. '.group', 0, KEYS[1])\n"               \
+    "if owner[1] == ARGV[1] and owner[2] then\n"                          \
+    "  redis.call('ZADD', KEYS[1], 0, owner[2])\n"                        \
+    "end\n"                                                               \
+    "return 1\n"
+
+/*
+ * SSC_LUA_SENDMAIL adds the mail ARGV (date, time, sender, message) to the
+ * inbox KEYS[1] under the next id of KEYS[2]. A mail is stored as one
+ * string "<id> <date> <time> <sender> <message>".
+ */
+#define SSC_LUA_SENDMAIL                                                  \
+    "local id = redis.call('INCR', KEYS[2])\n"                            \
+    "local mail = id .. ' ' .. table.concat(ARGV, ' ')\n"                 \
+    "redis.call('ZADD', KEYS[1], id, mail)\n"                             \
+    "return id\n"
+
+/*
+ * rs_list() turns an array reply of strings into a str_list, the reply is
+ * freed.
+ */
+static str_list *rs_list(redisReply *reply) {
+    if (reply == NULL) return NULL;
+    if (reply->type != REDIS_REPLY_ARRAY) {
+        freeReplyObject(reply);
+        return NULL;
+    }
+
+    const char **items = malloc((reply->elements + 1) * sizeof(char *));
+    if (items == NULL) {
+        freeReplyObject(reply);
+        return NULL;
+    }
+    for (size_t i = 0; i < reply->elements; i++) {
+        items[i] = (reply->element[i]->str) ? reply->element[i]->str : "";
+    }
+    str_list *list = str_list_new(reply->elements, items);
+    free(items);
+    freeReplyObject(reply);
+    return list;
+}
+
+/*
+ * SSC_LUA_QUEUEMSG queues "<time> <sender> <message>" (ARGV[1..3]) to
+ * KEYS[1], which keeps the last ARGV[4] messages and expires ARGV[5]
+ * seconds after the last one.
+ */
+#define SSC_LUA_QUEUEMSG                                                  \
+    "local msg = ARGV[1] .. ' ' .. ARGV[2] .. ' ' .. ARGV[3]\n"           \
+    "redis.call('RPUSH', KEYS[1], msg)\n"                                 \
+    "redis.call('LTRIM', KEYS[1], -tonumber(ARGV[4]), -1)\n"              \
+    "redis.call('EXPIRE', KEYS[1], ARGV[5])\n"                            \
+    "return 1\n"
+
+/*
+ * SSC_LUA_TAKEMSGS empties the queue KEYS[1] and returns the messages
+ * queued at ARGV[1] or later.
+ */
+#define SSC_LUA_TAKEMSGS                                                  \
+    "local msgs = redis.call('LRANGE', KEYS[1], 0, -1)\n"                 \
+    "redis.call('DEL', KEYS[1])\n"                                        \
+    "local live, since = {}, tonumber(ARGV[1])\n"                         \
+    "for _, msg in ipairs(msgs) do\n"                                     \
+    "  if (tonumber(msg:match('^%d+')) or 0) >= since then\n"             \
+    "    live[#live + 1] = msg\n"                                         \
+    "  end\n"                                                             \
+    "end\n"                                                               \
+    "return live\n"
+
+/*
+ * rs_split_list() splits every string of an array reply at its first
+ * n - 1 spaces, into n items. The reply is freed.
+ */
+static str_list *rs_split_list(redisReply *reply, int n) {
+    if (reply == NULL) return NULL;
+    if (reply->type != REDIS_REPLY_ARRAY) {
+        freeReplyObject(reply);
+        return NULL;
+    }
+
+    size_t len = reply->elements * n;
+    const char **items = malloc((len + 1) * sizeof(char *));
+    if (items == NULL) {
+        freeReplyObject(reply);
+        return NULL;
+    }
+    for (size_t i = 0; i < reply->elements; i++) {
+        const char **split = items + i * n;
+        char *str = (reply->element[i]->str) ? reply->element[i]->str : "";
+        for (int j = 0; j < n - 1; j++) {
+            split[j] = str;
+            if ((str = strchr(str, ' ')) == NULL) {
+                str = ""; /* malformed, the items left are empty */
+                continue;
+            }
+            *str++ = '\0';
+        }
+        split[n - 1] = str;
+    }
+    str_list *list = str_list_new(len, items);
+    free(items);
+    freeReplyObject(reply);
+    return list;
+}
+
+/*
+ * rs_integer() returns the integer reply, or -1 if redis failed.
+ */
+static long rs_integer(redisReply *reply) {
+    if (reply == NULL) return -1;
+    long rtv = (reply->type == REDIS_REPLY_INTEGER) ? reply->integer : -1;
+    freeReplyObject(reply);
+    return rtv;
+}
+
+static int rs_init() {
+    if (db_init() == -1) return -1;
+    cache_init();
+    return 0;
+}
+
+static int rs_user_exists(const char *name) {
+    int rtv = cache_user(name);
+    if (rtv != SSC_CACHE_UNKNOWN) return rtv;
+
+    unsigned long epoch = cache_epoch();
+    rtv = rs_integer(db_command("SISMEMBER Chatroom %s", name));
+    if (rtv != -1) cache_set_user(name, rtv, epoch);
+    return rtv;
+}
+
+static int rs_add_user(const char *name) {
+    if (rs_integer(db_command("SADD Chatroom %s", name)) == -1) return -1;
+    cache_changed("Chatroom");
+    cache_set_user(name, 1, cache_epoch());
+    return 0;
+}
+
+static int rs_check_passwd(const char *name, const char *passwd) {
+    const char *cached = cache_passwd(name);
+    if (cached) return (strcmp(cached, passwd) == 0) ? 1 : 0;
+
+    int rtv = 0;
+    unsigned long epoch = cache_epoch();
+    redisReply *reply;
+    reply = db_command("GET %s", name);
+    if (reply == NULL) return -1;
+    if (reply->type == REDIS_REPLY_NIL) {
+        /* another first login may set the password meanwhile, it wins */
+        freeReplyObject(reply);
+        reply = db_command("SET %s %s NX", name, passwd);
+        if (reply == NULL) return -1;
+        if (reply->type == REDIS_REPLY_STATUS) rtv = 1;
+        if (reply->type == REDIS_REPLY_ERROR) rtv = -1;
+        freeReplyObject(reply);
+        if (rtv == -1) return -1;
+        if (rtv == 1) {
+            cache_changed(name);
+            cache_set_passwd(name, passwd, cache_epoch());
+            return 1;
+        }
+        epoch = cache_epoch();
+        if ((reply = db_command("GET %s", name)) == NULL) return -1;
+    }
+    if (reply->type == REDIS_REPLY_STRING) {
+        rtv = (strcmp(reply->str, passwd) == 0) ? 1 : 0;
+        cache_set_passwd(name, reply->str, epoch);
+    }
+    freeReplyObject(reply);
+    return rtv;
+}
+
+#define SSC_NODE_TTL (SSC_HEARTBEAT * SSC_HEARTBEAT_LOST)
+
+static void rs_set_online(const char *name, int online) {
+    if (online) {
+        db_send("SADD Chatroom.online.%s %s", bus_node(), name);
+        db_send("EXPIRE Chatroom.online.%s %d", bus_node(), SSC_NODE_TTL);
+    } else {
+        db_send("SREM Chatroom.online.%s %s", bus_node(), name);
+    }
+}
+
+/*
+ * rs_heartbeat() keeps the node alive. A node has a new id every time it
+ * starts, so whoever was logged in before a restart or a crash is offline
+ * once the keys of the old id expire.
+ */
+static void rs_heartbeat() {
+    db_send("SET Chatroom.node.%s 1 EX %d", bus_node(), SSC_NODE_TTL);
+    db_send("SADD Chatroom.nodes %s", bus_node());
+    db_send("EXPIRE Chatroom.online.%s %d", bus_node(), SSC_NODE_TTL);
+}
+
+static int rs_is_online(const char *name) {
+    return rs_integer(db_command("EVAL %s 0 %s", SSC_LUA_ISONLINE, name));
+}
+
+static str_list *rs_offline_users() {
+    return rs_list(db_command("EVAL %s 0", SSC_LUA_OFFLINE));
+}
+
+static int rs_rename_user(const char *old_name, const char *new_name) {
+    redisReply *reply =
+        db_command("EVAL %s 0 %s %s Chatroom.online.%s", SSC_LUA_RENAME,
+                   old_name, new_name, bus_node());
+    if (reply == NULL) return -1;
+    if (reply->type != REDIS_REPLY_ARRAY) {
+        int rtv = (reply->type == REDIS_REPLY_INTEGER) ? 0 : -1;
+        freeReplyObject(reply);
+        return rtv;
+    }
+
+    for (int i = 0; i < reply->elements; i++) {
+        cache_changed(reply->element[i]->str);
+    }
+    freeReplyObject(reply);
+    cache_changed("Chatroom");
+    cache_changed(old_name);
+    cache_changed(new_name);
+    cache_set_user(old_name, 0, cache_epoch());
+    cache_set_user(new_name, 1, cache_epoch());
+    return 1;
+}
+
+static int rs_group_exists(const char *group) {
+    int rtv = cache_group(group);
+    if (rtv != SSC_CACHE_UNKNOWN) return rtv;
+
+    unsigned long epoch = cache_epoch();
+    rtv = rs_integer(db_command("SISMEMBER Chatroom.group %s", group));
+    if (rtv != -1) cache_set_group(group, rtv, epoch);
+    return rtv;
+}
+
+static str_list *rs_groups() {
+    return rs_list(db_command("SMEMBERS Chatroom.group"));
+}
+
+static str_list *rs_groups_of(const char *name) {
+    return rs_list(db_command("LRANGE %s.group 0 -1", name));
+}
+
+/*
+ * The members are cached, a copy is handed to the caller.
+ */
+static str_list *rs_members(const char *group) {
+    str_list *members = cache_members(group);
+    if (members) {
+        return str_list_new(members->len, (const char **)members->items);
+    }
+
+    unsigned long epoch = cache_epoch();
+    members = rs_list(db_command("ZRANGE %s 0 -1", group));
+    if (members == NULL) return NULL;
+
+    cache_set_members(group, members, epoch);
+    if (cache_members(group) != members) return members;
+    return str_list_new(members->len, (const char **)members->items);
+}
+
+static int rs_create_group(const char *group, const char *owner) {
+    int rtv = rs_integer(
+        db_command("EVAL %s 1 %s %s", SSC_LUA_CREATEGROUP, group, owner));
+    cache_changed(group);
+    if (rtv == 1) {
+        cache_changed("Chatroom.group");
+        cache_set_group(group, 1, cache_epoch());
+    }
+    return rtv;
+}
+
+static int rs_delete_group(const char *group, const char *owner) {
+    int rtv = rs_integer(
+        db_command("EVAL %s 1 %s %s", SSC_LUA_DELGROUP, group, owner));
+    if (rtv == 1) {
+        cache_changed(group);
+        cache_changed("Chatroom.group");
+        cache_set_group(group, 0, cache_epoch());
+    }
+    return rtv;
+}
+
+static int rs_join_group(const char *group, const char *name, int prior) {
+    int rtv = rs_integer(db_command("EVAL %s 1 %s %s %d", SSC_LUA_JOINGROUP,
+                                    group, name, prior));
+    cache_changed(group);
+    return rtv;
+}
+
+static int rs_quit_group(const char *group, const char *name) {
+    int rtv = rs_integer(
+        db_command("EVAL %s 1 %s %s", SSC_LUA_QUITGROUP, group, name));
+    cache_changed(group);
+    return rtv;
+}
+
+static str_list *rs_mails(const char *name, long offset, long count) {
+    if (offset < 0 || count == 0) return str_list_new(0, NULL);
+    long last = (count < 0) ? -1 : offset + count - 1;
+    return rs_split_list(
+        db_command("ZRANGE %s.inbox %ld %ld", name, offset, last),
+        SSC_MAIL_ITEMS);
+}
+
+static long rs_mail_count(const char *name) {
+    return rs_integer(db_command("ZCARD %s.inbox", name));
+}
+
+static int rs_send_mail(const char *to, const char *from, const char *msg) {
+    char date[16], time[16];
+    if (mail_stamp(date, sizeof(date), time, sizeof(time)) == -1) return -1;
+
+    long rtv = rs_integer(
+        db_command("EVAL %s 2 %s.inbox %s.inbox.id %s %s %s %s",
+                   SSC_LUA_SENDMAIL, to, to, date, time, from, msg));
+    return (rtv == -1) ? -1 : 0;
+}
+
+static int rs_delete_mail(const char *name, long id) {
+    return rs_integer(
+        db_command("ZREMRANGEBYSCORE %s.inbox %ld %ld", name, id, id));
+}
+
+static int rs_queue_msg(const char *name, const char *from, const char *msg) {
+    long rtv = rs_integer(
+        db_command("EVAL %s 1 %s.pending %ld %s %s %d %d", SSC_LUA_QUEUEMSG,
+                   name, (long)time(NULL), from, msg, SSC_PENDING_MAX,
+                   SSC_PENDING_TTL));
+    return (rtv == -1) ? -1 : 0;
+}
+
+static str_list *rs_take_msgs(const char *name) {
+    return rs_split_list(
+        db_command("EVAL %s 1 %s.pending %ld", SSC_LUA_TAKEMSGS, name,
+                   (long)time(NULL) - SSC_PENDING_TTL),
+        SSC_PENDING_ITEMS);
+}
+
+const store redis_store = {
+    .name = "redis",
+    .init = rs_init,
+    .user_exists = rs_user_exists,
+    .add_user = rs_add_user,
+    .check_passwd = rs_check_passwd,
+    .set_online = rs_set_online,
+    .is_online = rs_is_online,
+    .heartbeat = rs_heartbeat,
+    .offline_users = rs_offline_users,
+    .rename_user = rs_rename_user,
+    .group_exists = rs_group_exists,
+    .groups = rs_groups,
+    .groups_of = rs_groups_of,
+    .members = rs_members,
+    .create_group = rs_create_group,
+    .delete_group = rs_delete_group,
+    .join_group = rs_join_group,
+    .quit_group = rs_quit_group,
+    .mails = rs_mails,
+    .mail_count = rs_mail_count,
+    .send_mail = rs_send_mail,
+    .delete_mail = rs_delete_mail,
+    .queue_msg = rs_queue_msg,
+    .take_msgs = rs_take_msgs,
+    .forget = cache_forget,
+};
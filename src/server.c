@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -8,19 +9,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
-
-#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
 #include <sys/socket.h>
 
+#include "bus.h"
+#include "cmdline.h"
 #include "console.h"
-#include "hiredis.h"
-#include "read.h"
+#include "coro.h"
+#include "db.h"
+#include "hashmap.h"
+#include "intern.h"
+#include "mailbox.h"
+#include "outq.h"
 #include "server.h"
+#include "spawner.h"
+#include "stats.h"
+#include "store.h"
 #include "utils.h"
 
 #ifndef EXIT_IF_FAIL
@@ -38,8 +51,68 @@
 #define SSC_EXECING 8    /* user's input under executing */
 #define SSC_REQPASSWD 16 /* request user input password */
 
-int do_name(struct __cmd_element name, char *params, ...);
-int add_user_to_group(char *group, char *name, int prior);
+#define SSC_MAX_EVENTS 64 /* epoll events handled per wake up */
+
+/* children are watched through pidfds, Linux 5.3 and later */
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/*
+ * Output of a user is queued and sent when the socket is writable. Once the
+ * queue is over SSC_OUTQ_HIGH_WATER the user's input isn't read until the
+ * client catches up, and a client over SSC_OUTQ_HARD_LIMIT is disconnected.
+ */
+#ifndef SSC_OUTQ_HIGH_WATER
+#define SSC_OUTQ_HIGH_WATER (64 * 1024)
+#endif
+#ifndef SSC_OUTQ_HARD_LIMIT
+#define SSC_OUTQ_HARD_LIMIT (1024 * 1024)
+#endif
+
+/*
+ * Input is framed by newline. A line longer than SSC_INPUT_LINE is cut, and
+ * SSC_INPUT_BUFFER bytes of pipelined lines are kept while the user is busy.
+ */
+#define SSC_INPUT_LINE 1024
+#define SSC_INPUT_BUFFER (16 * 1024)
+
+/*
+ * A pipeline which isn't executed in-process holds one of SSC_MAX_EXECS
+ * slots of the server while it runs, and may start at most SSC_USER_PROCS
+ * commands. Its output is spliced to the socket SSC_EXEC_CHUNK bytes at a
+ * time while the output queue is empty, and read into the queue otherwise.
+ */
+#ifndef SSC_MAX_EXECS
+#define SSC_MAX_EXECS 64
+#endif
+#ifndef SSC_USER_PROCS
+#define SSC_USER_PROCS 8
+#endif
+#define SSC_EXEC_CHUNK (16 * 1024)
+
+#ifndef SSC_SERVER_IP
+#define SSC_SERVER_IP "172.22.46.36"
+#endif
+#define SSC_SERVER_PORT 4321
+
+/*
+ * Worker 0 serves the stats in the Prometheus text format over HTTP on a
+ * port of the loopback, see stats.h.
+ */
+#define SSC_STATS_IP "127.0.0.1"
+#define SSC_STATS_PORT 4322
+
+#define SSC_MAX_WORKERS 256 /* upper bound of "server start <workers>" */
+
+#define SSC_MSG_TELL 1 /* deliver to one user of the worker */
+#define SSC_MSG_YELL 2 /* deliver to every user of the worker */
+#define SSC_MSG_FORGET 3 /* a key of the store was written, see store.h */
+
+int add_user_to_group(char *group, const char *name, int prior);
 
 typedef struct __ipv4_server {
     int socket_fd;
@@ -48,29 +121,160 @@ typedef struct __ipv4_server {
 } ipv4_server;
 
 /*
- * __chatroom_user is the data structure storing user info.
+ * __chatroom_user is the data structure storing user info. The fields
+ * looked at by every event and every walk of user_list come first, they
+ * share a cache line.
  * fd pointer point to the file descripter which belong to the user.
- * name is the user name.
  * status is the user status.
  *   - 0: there is no user info now (not yet send a msg to request user name)
  *   - 1: there is no user info now (already send a msg to request user name)
  *   - 2: named user.
+ * worker is the id of the worker thread serving the user.
+ * closing is set if the user will be disconnected in flush_users().
+ * eof is set once the client has sent everything, the user is disconnected
+ * when its input is executed and its output sent.
+ * children is the number of processes executing a pipeline for the user,
+ * a console or the spawned binaries.
+ * name is the user name, an interned string (see intern.h), NULL until the
+ * user has given one.
  * next, prev pointers are next user and previous user.
+ * job is the line being executed, it may be waiting for redis.
+ * in keeps input which isn't processed yet (in_len bytes), it's given back
+ * once every line is consumed.
+ * out is the output waiting for the socket to be writable.
+ * exec_out is the read end of the pipe which the running pipeline writes
+ * to, exec_group is the process group to kill if the user goes away.
+ * pending_next links the users in pending_users.
  */
 typedef struct __chatroom_user {
     pfd_element *fd;
-    char name[1024];
     int status;
-    pid_t console;
+    int worker;
+    int closing, pending, eof;
+    int children;
+    const char *name;
     struct __chatroom_user *next, *prev;
+    struct __line_job *job;
+
+    char *in;
+    size_t in_len;
+    out_queue out;
+    pfd_element *exec_out;
+    pid_t exec_group;
+    struct __chatroom_user *pending_next;
 } chatroom_user;
 
+void process_input(chatroom_user *user);
+void user_prompt(chatroom_user *user);
+void exec_cancel(chatroom_user *user);
+void unindex_user_name(chatroom_user *user);
+
+/*
+ * __line_job is an input line executed in a coroutine, so a command waiting
+ * for redis suspends only its own user. The event loop goes on and the
+ * reply resumes the job where it stopped.
+ *
+ * The line is parsed in place (see cmdline.h), whatever else it needs is
+ * allocated from the arena of the job, which is reset when the line is
+ * done. Finished jobs are kept for reuse with their arena.
+ */
+typedef struct __line_job {
+    chatroom_user *user;
+    int discard; /* what the builtins print is dropped */
+    int capture; /* or written to this file, -1 for the user */
+    arena arena;
+    struct __line_job *next_free;
+    char line[SSC_INPUT_LINE];
+} line_job;
+
+#define SSC_MAX_FREE_JOBS 64 /* finished jobs kept for reuse */
+
+arena *line_arena();
+
+/*
+ * __worker is a thread running its own event loop. It owns a listening
+ * socket (SO_REUSEPORT lets the kernel spread connections over workers) and
+ * a shard of the users. Other workers deliver messages to its users through
+ * box. A process started for one of its users is watched by the event loop
+ * through a pidfd (an SSC_PIDFD pfd owned by the user).
+ */
+typedef struct __worker {
+    int id;
+    pthread_t thread;
+    mailbox box;
+} worker;
+
+/*
+ * __shard_msg is a line sent to the users of another worker, the message
+ * holds a reference of buf. to is the recipient of SSC_MSG_TELL, or the key
+ * of SSC_MSG_FORGET which has no buf.
+ */
+typedef struct __shard_msg {
+    mailbox_node node;
+    int type;
+    out_buf *buf;
+    char to[];
+} shard_msg;
+
+static worker *workers = NULL;
+static int worker_count = 0;
+
+/* pipelines running in the whole server, see SSC_MAX_EXECS */
+static int execs_running = 0;
+
+/*
+ * chat_store keeps the users, groups and mail, it's chosen by "server start"
+ * before the workers run.
+ */
+static const store *chat_store = &redis_store;
+static __thread worker *self_worker = NULL;
+
 /*
+ * user_dir maps the name of every logged-in user to its chatroom_user, so
+ * a worker can find the shard of a recipient. Other workers only read the
+ * worker field of the user, and only while holding user_dir_lock.
+ */
+static hashmap user_dir;
+static pthread_rwlock_t user_dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * The rest of the server state belongs to a worker thread.
+ *
  * user_list is maintin in circular linked-list
  */
-static chatroom_user *user_list = NULL;
+static __thread chatroom_user *user_list = NULL;
+
+/*
+ * user_by_name indexes logged-in users by name (the key is user->name),
+ * user_by_fd maps a client socket back to its user.
+ */
+static __thread hashmap user_by_name;
+static __thread chatroom_user **user_by_fd = NULL;
+static __thread int user_by_fd_len = 0;
+
+/*
+ * pending_users are users with output to flush or waiting to be closed,
+ * flush_users() walks them after every batch of events.
+ */
+static __thread chatroom_user *pending_users = NULL;
+
+static __thread slab user_slab = SLAB_INIT(chatroom_user);
+static __thread line_job *job_free_list = NULL;
+static __thread int job_free_len = 0;
+
+/*
+ * in_console is set in a forked console, whose output can't wait for the
+ * event loop and is written to its stdout directly.
+ */
+static __thread int in_console = 0;
+
+/*
+ * Builtin commands print their result into cmd_out. A forked console points
+ * it at stdout, while commands executed in-process write through an
+ * unbuffered cookie stream into the output of the running job's user.
+ */
+static __thread FILE *cmd_out = NULL;
 
-redisContext *redisdb = NULL;
 /*
  * ipv4_config() will return socket fd with AF_INET and SOCK_STREAM.
  */
@@ -81,6 +285,10 @@ int ipv4_config(struct __ipv4_server *server, int ip, int port,
                         : socket(AF_INET, SOCK_STREAM, 0);
 
     EXIT_IF_FAIL(socket_fd, -1, "socket()");
+    int reuse = 1;
+    EXIT_IF_FAIL(setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                            sizeof(reuse)),
+                 -1, "setsockopt()");
     server->server_addr.sin_family = AF_INET;
     server->server_addr.sin_addr.s_addr = ip;
     server->server_addr.sin_port = port;
@@ -96,11 +304,135 @@ int ipv4_config(struct __ipv4_server *server, int ip, int port,
     return socket_fd;
 }
 
+chatroom_user *find_user(const char *name) {
+    if (name == NULL) return NULL;
+    return hashmap_get(&user_by_name, name);
+}
+
+chatroom_user *fd_to_user(int fd) {
+    if (fd < 0 || fd >= user_by_fd_len) return NULL;
+    return user_by_fd[fd];
+}
+
+int index_user_fd(chatroom_user *user) {
+    int fd = user->fd->read;
+    if (fd >= user_by_fd_len) {
+        int len = (user_by_fd_len) ? user_by_fd_len : 64;
+        while (len <= fd) len <<= 1;
+
+        chatroom_user **table = realloc(user_by_fd, len * sizeof(*table));
+        if (table == NULL) return -1;
+        memset(table + user_by_fd_len, 0,
+               (len - user_by_fd_len) * sizeof(*table));
+        user_by_fd = table;
+        user_by_fd_len = len;
+    }
+    user_by_fd[fd] = user;
+    return 0;
+}
+
+/*
+ * A name is logged in once, index_user_name() fails if another connection
+ * has it already, so every connected user can be reached.
+ *
+ * A forked console has a copy of the users, which would be lost along with
+ * any change, and the locks may have been held by another thread when it
+ * was forked. The names of the users are only changed in the worker.
+ */
+int index_user_name(chatroom_user *user) {
+    if (in_console) return -1;
+
+    pthread_rwlock_wrlock(&user_dir_lock);
+    int rtv = -1;
+    if (hashmap_get(&user_dir, user->name) == NULL) {
+        rtv = hashmap_put(&user_dir, user->name, user);
+    }
+    pthread_rwlock_unlock(&user_dir_lock);
+
+    if (rtv == -1) return -1;
+    if (hashmap_put(&user_by_name, user->name, user) == -1) {
+        unindex_user_name(user);
+        return -1;
+    }
+    return 0;
+}
+
+void unindex_user_name(chatroom_user *user) {
+    if (in_console || user->name == NULL) return;
+
+    pthread_rwlock_wrlock(&user_dir_lock);
+    if (hashmap_get(&user_dir, user->name) == user) {
+        hashmap_del(&user_dir, user->name);
+    }
+    pthread_rwlock_unlock(&user_dir_lock);
+
+    if (find_user(user->name) == user) hashmap_del(&user_by_name, user->name);
+}
+
+/*
+ * find_worker() returns the id of the worker serving name, or -1 if name is
+ * offline.
+ */
+int find_worker(const char *name) {
+    pthread_rwlock_rdlock(&user_dir_lock);
+    chatroom_user *user = hashmap_get(&user_dir, name);
+    int id = (user) ? user->worker : -1;
+    pthread_rwlock_unlock(&user_dir_lock);
+    return id;
+}
+
+/*
+ * set_user_name() replaces the name of user by the interned name.
+ */
+int set_user_name(chatroom_user *user, const char *name) {
+    if (in_console) return -1;
+    const char *interned = intern(name);
+    if (interned == NULL) return -1;
+    intern_release(user->name);
+    user->name = interned;
+    return 0;
+}
+
+/*
+ * An idle user doesn't keep an input buffer, the buffer is taken when input
+ * arrives and given back once every line is consumed. A worker keeps one
+ * buffer for the next user, so a line read at once doesn't touch the heap.
+ */
+static __thread char *spare_input = NULL;
+
+char *get_input_buffer(chatroom_user *user) {
+    if (user->in) return user->in;
+    if (spare_input) {
+        user->in = spare_input;
+        spare_input = NULL;
+    } else {
+        user->in = malloc(SSC_INPUT_BUFFER);
+    }
+    return user->in;
+}
+
+void put_input_buffer(chatroom_user *user) {
+    if (user->in == NULL) return;
+    if (spare_input == NULL) {
+        spare_input = user->in;
+    } else {
+        free(user->in);
+    }
+    user->in = NULL;
+    user->in_len = 0;
+}
+
 chatroom_user *add_user(pfd_element *pfd) {
-    chatroom_user *new_user = calloc(1, sizeof(chatroom_user));
+    chatroom_user *new_user = slab_alloc(&user_slab);
     if (new_user == NULL) return NULL;
+    memset(new_user, 0, sizeof(chatroom_user));
 
     new_user->fd = pfd;
+    new_user->worker = self_worker->id;
+    if (index_user_fd(new_user) == -1) {
+        slab_free(&user_slab, new_user);
+        return NULL;
+    }
 
     if (user_list == NULL) {
         user_list = new_user;
@@ -128,19 +460,32 @@ chatroom_user *register_ipv4conn(int socket_fd, struct __ipv4_server *server,
     int fd[2] = {confd, confd};
     pfd_element *new_pfd = add_pfd(fd, SSC_SOCK_CLIENT);
 
-    return add_user(new_pfd);
+    chatroom_user *new_user = add_user(new_pfd);
+    if (new_user == NULL) {
+        close_pfd(new_pfd);
+        return NULL;
+    }
+    watch_pfd(new_pfd, EPOLLIN);
+    stats_add(STAT_ACCEPTED, 1);
+    return new_user;
 }
 
 chatroom_user *close_user(chatroom_user *user) {
     if (user == NULL) return NULL;
 
+    stats_add(STAT_CLOSED, 1);
+    unindex_user_name(user);
+    intern_release(user->name);
+    user_by_fd[user->fd->read] = NULL;
     close_pfd(user->fd);
+    put_input_buffer(user);
+    outq_free(&user->out);
 
     if (user_list == user) {
         user_list = user_list->prev;
     }
     if (user->prev == user) {
-        free(user);
+        slab_free(&user_slab, user);
         user_list = NULL;
         return NULL;
     }
@@ -148,292 +493,1314 @@ chatroom_user *close_user(chatroom_user *user) {
     chatroom_user *prev = user->prev;
     user->prev->next = user->next;
     user->next->prev = user->prev;
-    free(user);
+    slab_free(&user_slab, user);
     return prev;
 }
 
-char *input_filter(char *input) {
-    /* truncate the input until read invalid charater. */
-    char *output = calloc(strlen(input), sizeof(char) + 1);
-    char *start = output;
-    for (; *input > 31 && *input < 127; input++) {
-        *start++ = *input;
-    }
-    if (start == output) {
-        free(output);
-        return NULL;
+void schedule_user(chatroom_user *user) {
+    if (user->pending) return;
+    user->pending = 1;
+    user->pending_next = pending_users;
+    pending_users = user;
+}
+
+void disconnect_user(chatroom_user *user) {
+    user->closing = 1;
+    schedule_user(user);
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * user_write() and user_printf() queue output to the user, the queue is
+ * flushed by the event loop.
+ */
+int user_write(chatroom_user *user, const char *buf, size_t len) {
+    if (user == NULL || user->closing) return -1;
+    if (in_console) return write_all(user->fd->write, buf, len);
+
+    if (outq_append(&user->out, buf, len) == -1 ||
+        user->out.bytes > SSC_OUTQ_HARD_LIMIT) {
+        disconnect_user(user);
+        return -1;
+    }
+    schedule_user(user);
+    return 0;
+}
+
+/*
+ * user_write_buf() queues a buffer shared with other users, without copying
+ * it.
+ */
+int user_write_buf(chatroom_user *user, out_buf *buf) {
+    if (user == NULL || user->closing) return -1;
+    if (in_console) return write_all(user->fd->write, buf->data, buf->len);
+
+    if (outq_append_buf(&user->out, buf) == -1 ||
+        user->out.bytes > SSC_OUTQ_HARD_LIMIT) {
+        disconnect_user(user);
+        return -1;
+    }
+    schedule_user(user);
+    return 0;
+}
+
+int user_printf(chatroom_user *user, const char *fmt, ...) {
+    if (user == NULL || user->closing) return -1;
+
+    va_list ap;
+    va_start(ap, fmt);
+    if (in_console) {
+        int rtv = vdprintf(user->fd->write, fmt, ap);
+        va_end(ap);
+        return rtv;
+    }
+    int rtv = outq_vprintf(&user->out, fmt, ap);
+    va_end(ap);
+
+    if (rtv == -1 || user->out.bytes > SSC_OUTQ_HARD_LIMIT) {
+        disconnect_user(user);
+        return -1;
+    }
+    schedule_user(user);
+    return 0;
+}
+
+int post_msg(int id, int type, const char *to, out_buf *buf) {
+    size_t to_len = (to) ? strlen(to) + 1 : 0;
+    shard_msg *msg = malloc(sizeof(shard_msg) + to_len);
+    if (msg == NULL) return -1;
+
+    msg->type = type;
+    msg->buf = (buf) ? outbuf_ref(buf) : NULL;
+    if (to) memcpy(msg->to, to, to_len);
+
+    mailbox_push(&workers[id].box, &msg->node);
+    return 0;
+}
+
+/*
+ * post_buf() passes buf to the users of another worker, to is the
+ * recipient, or NULL for every user of that worker.
+ */
+int post_buf(int id, const char *to, out_buf *buf) {
+    return post_msg(id, (to) ? SSC_MSG_TELL : SSC_MSG_YELL, to, buf);
+}
+
+/*
+ * broadcast() sends buf to every user of every worker. The line is queued
+ * by each connection as it is, one buffer serves the whole chatroom.
+ */
+void broadcast(out_buf *buf) {
+    if (user_list) {
+        chatroom_user *tmp = user_list;
+        do {
+            user_write_buf(tmp, buf);
+            tmp = tmp->next;
+        } while (tmp != user_list);
+    }
+
+    for (int i = 0; !in_console && i < worker_count; i++) {
+        if (i == self_worker->id) continue;
+        post_buf(i, NULL, buf);
+    }
+}
+
+/*
+ * send_user() delivers buf to name on whichever worker serves it, it
+ * returns -1 if name is offline. A forked console only reaches the users
+ * of its own worker, its memory isn't the server's anymore.
+ */
+int send_user(const char *name, out_buf *buf) {
+    chatroom_user *target = find_user(name);
+    if (target) {
+        user_write_buf(target, buf);
+        return 0;
+    }
+    if (in_console) return -1;
+
+    int id = find_worker(name);
+    if (id == -1 || id == self_worker->id) return -1;
+    return post_buf(id, name, buf);
+}
+
+/*
+ * tell_or_queue() sends line, which tells msg, to name. A user logged in on
+ * another node which is alive gets line through the bus, on the channel of
+ * the user unless line was published to a group of the user already. If
+ * name is offline, or its node is gone, msg is queued until name logs in.
+ *
+ * It returns 0 if msg was told, 1 if it was queued, -1 if name isn't a
+ * user. A forked console can't tell whether a user of another worker is
+ * online, so it never queues.
+ */
+int tell_or_queue(const char *name, out_buf *line, const char *from,
+                  const char *msg, int published) {
+    if (send_user(name, line) == 0) return 0;
+    if (in_console) return -1;
+    if (bus_remote() && chat_store->is_online(name) == 1) {
+        if (!published) bus_publish(SSC_BUS_USER, name, line->data);
+        return 0;
+    }
+    if (chat_store->user_exists(name) != 1) return -1;
+    return (chat_store->queue_msg(name, from, msg) == 0) ? 1 : -1;
+}
+
+/*
+ * bus_group_job is a group line of another node, delivered by a coroutine
+ * of the subscribing worker since the members are read from the store. It
+ * isn't a line_job, so it must not use current_user() or cmd_out.
+ */
+typedef struct __bus_group_job {
+    out_buf *line;
+    char group[];
+} bus_group_job;
+
+void bus_group_run(void *arg) {
+    bus_group_job *job = arg;
+    str_list *members = chat_store->members(job->group);
+    for (size_t i = 0; members && i < members->len; i++) {
+        send_user(members->items[i], job->line);
+    }
+    free(members);
+}
+
+void bus_group_done(void *arg) {
+    bus_group_job *job = arg;
+    outbuf_unref(job->line);
+    free(job);
+}
+
+/*
+ * bus_deliver() hands a line of another node to the users of this node,
+ * and a write of a key, by any node, to the cache of every worker.
+ */
+void bus_deliver(int kind, const char *target, const char *line) {
+    if (kind == SSC_BUS_CACHE) {
+        if (chat_store->forget == NULL) return;
+        for (int i = 0; i < worker_count; i++) {
+            if (i == self_worker->id) {
+                chat_store->forget(target);
+            } else {
+                post_msg(i, SSC_MSG_FORGET, target, NULL);
+            }
+        }
+        return;
+    }
+
+    out_buf *buf = outbuf_printf("%s", line);
+    if (buf == NULL) return;
+
+    if (kind == SSC_BUS_YELL) {
+        broadcast(buf);
+    } else if (kind == SSC_BUS_USER) {
+        send_user(target, buf);
+    } else if (kind == SSC_BUS_GROUP) {
+        size_t len = strlen(target) + 1;
+        bus_group_job *job = malloc(sizeof(bus_group_job) + len);
+        coro *co = (job) ? coro_new(bus_group_run, bus_group_done, job) : NULL;
+        if (co) {
+            job->line = outbuf_ref(buf);
+            memcpy(job->group, target, len);
+            coro_resume(co);
+        } else {
+            free(job);
+        }
+    }
+    outbuf_unref(buf);
+}
+
+/*
+ * deliver_queued() writes the messages queued while user was offline, all
+ * of them with a single write.
+ */
+void deliver_queued(chatroom_user *user) {
+    str_list *msgs = chat_store->take_msgs(user->name);
+    if (msgs == NULL) return;
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = (msgs->len) ? open_memstream(&buf, &len) : NULL;
+    if (out) {
+        fprintf(out, "%zu message(s) while you were away:\n",
+                msgs->len / SSC_PENDING_ITEMS);
+        for (size_t i = 0; i + SSC_PENDING_ITEMS <= msgs->len;
+             i += SSC_PENDING_ITEMS) {
+            time_t t = strtol(msgs->items[i], NULL, 10);
+            struct tm tm;
+            char stamp[32] = "";
+            if (localtime_r(&t, &tm)) {
+                strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", &tm);
+            }
+            fprintf(out, "<user:%-10s told you at %s>: %s\n",
+                    msgs->items[i + 1], stamp, msgs->items[i + 2]);
+        }
+        if (fclose(out) == 0) user_write(user, buf, len);
+        free(buf);
+    }
+    free(msgs);
+}
+
+void update_user_events(chatroom_user *user) {
+    uint32_t events = 0;
+    if (user->out.bytes < SSC_OUTQ_HIGH_WATER &&
+        user->in_len < SSC_INPUT_BUFFER)
+        events |= EPOLLIN;
+    if (user->eof) events = 0;
+    if (user->out.bytes) events |= EPOLLOUT;
+    if (events == 0) {
+        unwatch_pfd(user->fd);
+    } else if (events != user->fd->events) {
+        watch_pfd(user->fd, events);
+    }
+
+    /* the pipeline goes on once the client caught up */
+    if (user->exec_out && user->exec_out->events == 0 &&
+        user->out.bytes < SSC_OUTQ_HIGH_WATER)
+        watch_pfd(user->exec_out, EPOLLIN);
+}
+
+void flush_users() {
+    while (pending_users) {
+        chatroom_user *user = pending_users;
+        pending_users = user->pending_next;
+        user->pending = 0;
+
+        if (!user->closing && outq_flush(&user->out, user->fd->write) == -1) {
+            user->closing = 1;
+        }
+        if (user->closing) {
+            /*
+             * a suspended job or a running child still refers to the user,
+             * close it later
+             */
+            if (user->children) exec_cancel(user);
+            if (user->job || user->children) continue;
+            if (user->status & (SSC_NAMED | SSC_REQINPUT | SSC_EXECING)) {
+                chat_store->set_online(user->name, 0);
+            }
+            close_user(user);
+            continue;
+        }
+        if (user->job == NULL && user->in_len) process_input(user);
+        if (user->eof && user->job == NULL &&
+            !(user->status & SSC_EXECING) && user->out.bytes == 0) {
+            disconnect_user(user);
+            continue;
+        }
+        update_user_events(user);
+    }
+}
+
+char *input_filter(arena *a, char *input) {
+    /* truncate the input until read invalid charater. */
+    size_t len = 0;
+    while (input[len] > 31 && input[len] < 127) len++;
+    if (len == 0) return NULL;
+    return arena_strndup(a, input, len);
+}
+
+int group_exist_in_system(char *group) {
+    if (group == NULL) return 1;
+    return chat_store->group_exists(group) == 1;
+}
+
+int name_exist_in_system(char *name) {
+    if (name == NULL) return 0;
+    return chat_store->user_exists(name) == 1;
+    // chatroom_user *tmp = user_list;
+    // do {
+    //     if (strcmp(name, tmp->name) == 0) return 1;
+    //     tmp = tmp->next;
+    // } while (tmp != user_list);
+    // return 0;
+}
+
+int init_waitingcmd(waiting_cmd *w_cmd, cmd_element *cmd, chatroom_user *user,
+                    char *args) {
+    w_cmd->read = w_cmd->write = NULL;
+    w_cmd->cmd_addr = cmd;
+    w_cmd->additional_data = NULL;
+    if (cmd->type & SSC_CMD_INPROC) {
+        w_cmd->additional_data = user;
+    } else if (strcmp(cmd->name, "quit") == 0) {
+        w_cmd->additional_data = (void *)getpid();
+    }
+    if (args) {
+        w_cmd->param = strdup(args);
+    } else {
+        w_cmd->param = NULL;
+    }
+    w_cmd->next = NULL;
+    return 0;
+}
+
+int register_user(char *name) {
+    /* TODO: */
+    return chat_store->add_user(name);
+}
+int check_passwd(const char *name, char *passwd) {
+    if (name == NULL || passwd == NULL) return -1;
+    return chat_store->check_passwd(name, passwd);
+}
+
+int user_stat_handler(chatroom_user *user, char *input) {
+    switch (user->status) {
+        case SSC_NONAME:
+            user_printf(user, "Who're you: ");
+            user->status = SSC_REQNAME;
+            return SSC_NONAME;
+            break;
+        case SSC_REQNAME:
+            if (input) {
+                char *neat_name = input_filter(line_arena(), input);
+                if (neat_name == NULL) {
+                    user->status = SSC_NONAME;
+                    return SSC_REQNAME;
+                }
+
+                /* SADD is a no-op for a registered name */
+                register_user(neat_name);
+                if (set_user_name(user, neat_name) == -1) {
+                    user->status = SSC_NONAME;
+                    return SSC_REQNAME;
+                }
+                user->status = SSC_REQPASSWD;
+                user_printf(user, "Password: ");
+            }
+            return SSC_REQNAME;
+            break;
+        case SSC_REQPASSWD:
+            if (input) {
+                char *neat_passwd = input_filter(line_arena(), input);
+
+                if (check_passwd(user->name, neat_passwd) == 1) {
+                    if (index_user_name(user) == -1) {
+                        user_printf(user, "%s is logged in already\n",
+                                    user->name);
+                        user->status = SSC_NONAME;
+                        return SSC_REQPASSWD;
+                    }
+                    /* Success */
+                    user_printf(user, "Welcome %s!\n", user->name);
+                    user->status = SSC_NAMED;
+
+                    chat_store->set_online(user->name, 1);
+                    deliver_queued(user);
+                } else {
+                    user_printf(user, "Password: ");
+                }
+            }
+            return SSC_REQPASSWD;
+            break;
+        case SSC_NAMED:
+            user_printf(user, "%s> ", user->name);
+            user->status = SSC_REQINPUT;
+            return SSC_NAMED;
+        case SSC_REQINPUT:
+            if (input) {
+                user->status = SSC_NAMED;
+            }
+            return SSC_REQINPUT;
+        default:
+            break;
+    }
+    return user->status;
+}
+
+/*
+ * current_user() is the user whose line is being executed, or NULL outside
+ * of a line_job.
+ */
+chatroom_user *current_user() {
+    line_job *job = coro_data(coro_self());
+    return (job) ? job->user : NULL;
+}
+
+/*
+ * line_arena() is the arena of the line being executed.
+ */
+arena *line_arena() {
+    line_job *job = coro_data(coro_self());
+    return (job) ? &job->arena : NULL;
+}
+
+ssize_t cmd_out_write(void *cookie, const char *buf, size_t size) {
+    line_job *job = coro_data(coro_self());
+    if (job && job->discard) return size;
+    if (job && job->capture != -1) return write(job->capture, buf, size);
+    user_write(current_user(), buf, size);
+    return size;
+}
+
+/*
+ * cmd_out is unbuffered, a job may be suspended in the middle of a command
+ * and the stream is shared by every job of the worker.
+ */
+int cmd_out_init() {
+    cookie_io_functions_t io = {.write = cmd_out_write};
+    cmd_out = fopencookie(NULL, "w", io);
+    if (cmd_out == NULL) return -1;
+    return setvbuf(cmd_out, NULL, _IONBF, 0);
+}
+
+/*
+ * exec_inproc_cmd() runs a single builtin inside the server process, so
+ * no fork() is paid and the command sees the real user_list.
+ */
+int exec_inproc_cmd(chatroom_user *user, waiting_cmd *cmd) {
+    uint64_t start = stats_now();
+    int rtv = cmd->cmd_addr->operation(*cmd->cmd_addr, cmd->param,
+                                       cmd->additional_data);
+    stats_record(HIST_CMD + cmd->cmd_addr->stat, stats_now() - start);
+    return rtv;
+}
+
+/*
+ * A "|" stage is the do_pipe builtin, it only copies its input to its
+ * output.
+ */
+static int is_pipe_stage(const cmd_element *cmd) {
+    return strcmp(cmd->name, "|") == 0;
+}
+
+/*
+ * run_builtin() runs the in-process builtin cmd in the worker, param stays
+ * in the line.
+ */
+static void run_builtin(chatroom_user *user, cmd_element *cmd, char *param) {
+    waiting_cmd wait_cmd;
+    init_waitingcmd(&wait_cmd, cmd, user, NULL);
+    wait_cmd.param = param;
+    exec_inproc_cmd(user, &wait_cmd);
+}
+
+/*
+ * run_inproc_pipeline() runs a pipeline of in-process builtins in the
+ * worker, one stage after the other, it returns 0 if the pipeline needs a
+ * console. A builtin never reads its input, so the output of a stage only
+ * reaches the user when nothing but "|" follows it. Any other output would
+ * be dropped by the next stage, so it's dropped right away.
+ *
+ * The stages never enter the waiting queue, which is shared by the
+ * worker's jobs while a command may suspend, and their parameters stay in
+ * the line.
+ */
+int run_inproc_pipeline(chatroom_user *user, cmd_line *cl,
+                        cmd_element *const *cmds) {
+    int last = -1;
+    for (int i = 0; i < cl->len; i++) {
+        if (is_pipe_stage(cmds[i])) continue;
+        if (!(cmds[i]->type & SSC_CMD_INPROC)) return 0;
+        last = i;
+    }
+    line_job *job = coro_data(coro_self());
+    if (last == -1 || job == NULL) return 0;
+
+    for (int i = 0; i <= last; i++) {
+        if (is_pipe_stage(cmds[i])) continue;
+        job->discard = (i != last);
+        run_builtin(user, cmds[i], cl->stages[i].param);
+    }
+    job->discard = 0;
+    return 1;
+}
+
+/*
+ * exec_begin() takes a slot for a pipeline of procs commands, see
+ * SSC_MAX_EXECS. What the pipeline prints is captured by a pipe, which the
+ * event loop reads into the output queue of the user (see exec_read()), so
+ * the output is sent like any other and a slow client holds the pipeline
+ * back. It returns the write end of the pipe, or -1 if the pipeline can't
+ * run.
+ */
+int exec_begin(chatroom_user *user, int procs) {
+    if (procs > SSC_USER_PROCS) {
+        user_printf(user, "too many commands, at most %d\n", SSC_USER_PROCS);
+        return -1;
+    }
+    if (__atomic_add_fetch(&execs_running, 1, __ATOMIC_RELAXED) >
+        SSC_MAX_EXECS) {
+        __atomic_sub_fetch(&execs_running, 1, __ATOMIC_RELAXED);
+        user_printf(user, "the server is busy, try again later\n");
+        return -1;
+    }
+
+    int fd[2];
+    pfd_element *pfd = NULL;
+    if (pipe2(fd, O_CLOEXEC) == 0) {
+        int rfd[2] = {fd[0], fd[0]};
+        fcntl(fd[0], F_SETFL, O_NONBLOCK);
+        if ((pfd = add_pfd(rfd, SSC_EXEC_OUT)) == NULL) {
+            close(fd[0]);
+            close(fd[1]);
+        }
+    }
+    if (pfd == NULL || watch_pfd(pfd, EPOLLIN) == -1) {
+        perror("exec_begin()");
+        if (pfd) {
+            close_pfd(pfd);
+            close(fd[1]);
+        }
+        __atomic_sub_fetch(&execs_running, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    pfd->owner = user;
+    user->exec_out = pfd;
+    user->status = SSC_EXECING;
+    return fd[1];
+}
+
+/*
+ * exec_splice() moves the output of the pipeline from the pipe to the
+ * socket in the kernel, as long as nothing is queued ahead of it. It
+ * returns 0 once the pipe is done with, -1 when the pipe is empty, the
+ * socket is full or broken. The worker blocks SIGPIPE (see worker_main()),
+ * the one raised by a broken socket is taken back here.
+ */
+static int exec_splice(chatroom_user *user) {
+    while (user->out.bytes == 0 && !user->closing) {
+        ssize_t len =
+            splice(user->exec_out->read, NULL, user->fd->write, NULL,
+                   SSC_EXEC_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len > 0) {
+            stats_add(STAT_BYTES_OUT, len);
+            continue;
+        }
+        if (len == 0) return 0;
+        if (errno == EINTR) continue;
+        if (errno == EPIPE) {
+            sigset_t pipe_set;
+            struct timespec now = {0, 0};
+            sigemptyset(&pipe_set);
+            sigaddset(&pipe_set, SIGPIPE);
+            sigtimedwait(&pipe_set, NULL, &now);
+        }
+        return -1;
+    }
+    return -1;
+}
+
+/*
+ * exec_read() moves the output of the pipeline to the user, until the
+ * output queue is over SSC_OUTQ_HIGH_WATER unless drain is set. While the
+ * queue is empty the output is spliced to the socket, what the socket
+ * doesn't take is read into the queue. It returns 1 if it stopped for the
+ * queue, 0 once the pipe is done with and -1 if the pipe is empty.
+ */
+int exec_read(chatroom_user *user, int drain) {
+    char buf[SSC_EXEC_CHUNK];
+    if (exec_splice(user) == 0) return 0;
+    while (drain || user->out.bytes < SSC_OUTQ_HIGH_WATER) {
+        ssize_t len = read(user->exec_out->read, buf, sizeof(buf));
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN) ? -1 : 0;
+        }
+        if (len == 0 || user_write(user, buf, len) == -1) return 0;
+    }
+    return 1;
+}
+
+void exec_output_handler(pfd_element *pfd) {
+    chatroom_user *user = pfd->owner;
+    /* exec_done() may have closed the pipe earlier in the batch */
+    if (user == NULL || pfd != user->exec_out) return;
+    int rtv = exec_read(user, 0);
+    if (rtv == 1) {
+        /* update_user_events() watches the pipe again */
+        unwatch_pfd(pfd);
+    } else if (rtv == 0) {
+        close_pfd(pfd);
+        user->exec_out = NULL;
+    }
+}
+
+/*
+ * exec_done() gives the slot of the pipeline back once every child of the
+ * user is reaped and the line which started them is done. The output left
+ * in the pipe is drained then, a writer which is gone can't fill it
+ * anymore.
+ */
+void exec_done(chatroom_user *user) {
+    if (user->children || user->job) return;
+    if (user->exec_out) {
+        exec_read(user, 1);
+        close_pfd(user->exec_out);
+        user->exec_out = NULL;
+    }
+    user->exec_group = 0;
+
+    if (user->status & SSC_EXECING) {
+        __atomic_sub_fetch(&execs_running, 1, __ATOMIC_RELAXED);
+        user->status = SSC_NAMED;
+        if (!user->closing) {
+            user_prompt(user);
+            process_input(user);
+        }
+    }
+    schedule_user(user);
+}
+
+/*
+ * exec_cancel() kills the pipeline of a user who went away, the children
+ * are still reaped by child_exit_handler().
+ */
+void exec_cancel(chatroom_user *user) {
+    if (user->exec_group > 0) kill(-user->exec_group, SIGKILL);
+    user->exec_group = 0;
+    close_pfd(user->exec_out);
+    user->exec_out = NULL;
+}
+
+/*
+ * watch_child() makes the event loop tell the user when pid exits, see
+ * child_exit_handler(). A child which can't be watched is killed, the user
+ * would wait for it forever.
+ */
+int watch_child(chatroom_user *user, pid_t pid) {
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    pfd_element *pfd = NULL;
+    if (pidfd != -1) {
+        int fd[2] = {pidfd, pidfd};
+        if ((pfd = add_pfd(fd, SSC_PIDFD)) == NULL) close(pidfd);
+    }
+    if (pfd == NULL || watch_pfd(pfd, EPOLLIN) == -1) {
+        perror("watch_child()");
+        close_pfd(pfd);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    pfd->owner = user;
+    user->children++;
+    return 0;
+}
+
+/*
+ * exec_pgid() is the process group of the pipeline of user, 0 until its
+ * first process is started. Only the worker reaps the processes of the
+ * group, so it can't be gone while the line is starting more of them,
+ * unless a builtin suspended the line.
+ */
+static pid_t exec_pgid(chatroom_user *user) {
+    if (user->exec_group && kill(-user->exec_group, 0) == -1) {
+        user->exec_group = 0;
+    }
+    return user->exec_group;
+}
+
+/*
+ * spawn_segment() starts a segment made of external binaries only with
+ * spawn_pipeline(), which doesn't copy the server like a console does.
+ * What can't be started is reported on out.
+ */
+void spawn_segment(chatroom_user *user, int n, cmd_element *const *cmds,
+                   char *const *params, int in, int out) {
+    pid_t pids[SSC_MAX_STAGES];
+    int started =
+        spawn_pipeline(n, cmds, params, in, out, exec_pgid(user), pids);
+    if (started == 0) return;
+
+    stats_add(STAT_SPAWNS, started);
+    if (user->exec_group == 0) user->exec_group = pids[0];
+    for (int i = 0; i < started; i++) watch_child(user, pids[i]);
+}
+
+/*
+ * fork_console() executes a segment in a copy of the server, which is
+ * needed as soon as a builtin has to run in its own process.
+ */
+void fork_console(chatroom_user *user, int n, cmd_element *const *cmds,
+                  char *const *params, int in, int out) {
+    for (int i = 0; i < n; i++) {
+        waiting_cmd wait_cmd;
+        init_waitingcmd(&wait_cmd, cmds[i], user, params[i]);
+        if (append_queue(wait_cmd) == -1) {
+            free_all_waiting_cmd();
+            dprintf(out, "console: %s\n", strerror(errno));
+            return;
+        }
+    }
+
+    stats_add(STAT_CONSOLES, 1);
+    stats_add(STAT_FORKS, n);
+    pid_t pgid = exec_pgid(user);
+    pid_t child = fork();
+    if (child == 0) {
+        /* child process */
+        setpgid(0, pgid);
+        in_console = 1;
+        /* the commands get SIGPIPE, which the worker blocks */
+        sigset_t pipe_set;
+        sigemptyset(&pipe_set);
+        sigaddset(&pipe_set, SIGPIPE);
+        pthread_sigmask(SIG_UNBLOCK, &pipe_set, NULL);
+        cmd_out = stdout;
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        /* the builtins write to the pipe as well */
+        user->fd->write = STDOUT_FILENO;
+        if (exec_all_waiting_cmd() == -1) {
+            exit(EXIT_FAILURE);
+        }
+        while (wait(NULL) != -1)
+            ;
+        exit(EXIT_SUCCESS);
+    }
+    /* parent process */
+    free_all_waiting_cmd();
+    if (child == -1) {
+        dprintf(out, "fork: %s\n", strerror(errno));
+        return;
+    }
+
+    setpgid(child, (pgid) ? pgid : child);
+    if (user->exec_group == 0) user->exec_group = child;
+    watch_child(user, child);
+}
+
+/*
+ * exec_segment() starts n stages which need processes, reading in and
+ * writing out (-1 for /dev/null). The processes of a line share a process
+ * group, see exec_cancel().
+ */
+void exec_segment(chatroom_user *user, int n, cmd_element *const *cmds,
+                  char *const *params, int in, int out) {
+    if (user->closing) return;
+
+    int null_fd = -1;
+    if ((in == -1 || out == -1) &&
+        (null_fd = open("/dev/null", O_RDWR | O_CLOEXEC)) == -1) {
+        user_printf(user, "/dev/null: %s\n", strerror(errno));
+        return;
+    }
+    if (in == -1) in = null_fd;
+    if (out == -1) out = null_fd;
+
+    int external = 1;
+    for (int i = 0; i < n; i++) {
+        if (!(cmds[i]->type & SSC_CMD_EXTERNAL)) external = 0;
+    }
+    if (external) {
+        spawn_segment(user, n, cmds, params, in, out);
+    } else {
+        fork_console(user, n, cmds, params, in, out);
+    }
+    if (null_fd != -1) close(null_fd);
+}
+
+/*
+ * capture_builtin() runs the in-process builtin cmd, what it prints is
+ * kept in a file which is returned to be read from the start, -1 if the
+ * output can't be kept.
+ */
+int capture_builtin(chatroom_user *user, cmd_element *cmd, char *param) {
+    line_job *job = coro_data(coro_self());
+    int fd = memfd_create("ssc-stage", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create()");
+        job->discard = 1;
+    }
+    job->capture = fd;
+    run_builtin(user, cmd, param);
+    job->capture = -1;
+    job->discard = 0;
+
+    if (fd != -1) lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/*
+ * exec_pipeline() executes a pipeline which needs processes. It's cut at
+ * its in-process builtins, which run in the worker so what they change
+ * isn't lost in a copy of the server. A builtin never reads its input:
+ * the segment before it only runs for what it does and its output is
+ * dropped, the output of the builtin is the input of the segment after
+ * it. "|" stages only copy their input to their output, they are left
+ * out. The last segment writes out.
+ */
+void exec_pipeline(chatroom_user *user, cmd_line *cl,
+                   cmd_element *const *cmds, int out) {
+    line_job *job = coro_data(coro_self());
+    cmd_element *seg[SSC_MAX_STAGES];
+    char *params[SSC_MAX_STAGES];
+    int n = 0, in = -1;
+    for (int i = 0; i < cl->len; i++) {
+        if (is_pipe_stage(cmds[i])) continue;
+        if (!(cmds[i]->type & SSC_CMD_INPROC)) {
+            seg[n] = cmds[i];
+            params[n++] = cl->stages[i].param;
+            continue;
+        }
+
+        if (n) exec_segment(user, n, seg, params, in, -1);
+        if (in != -1) close(in);
+        n = 0;
+        in = -1;
+
+        int next = i + 1;
+        while (next < cl->len && is_pipe_stage(cmds[next])) next++;
+        if (next == cl->len) {
+            run_builtin(user, cmds[i], cl->stages[i].param);
+        } else if (cmds[next]->type & SSC_CMD_INPROC) {
+            job->discard = 1;
+            run_builtin(user, cmds[i], cl->stages[i].param);
+            job->discard = 0;
+        } else {
+            in = capture_builtin(user, cmds[i], cl->stages[i].param);
+        }
+    }
+    if (n) exec_segment(user, n, seg, params, in, out);
+    if (in != -1) close(in);
+}
+
+int user_input_handler(chatroom_user *user, char *input) {
+    if (user_stat_handler(user, input) &
+        (SSC_REQNAME | SSC_EXECING | SSC_REQPASSWD))
+        return 0;
+    /* the line belongs to the job, the stages point into it */
+    cmd_line cl;
+    int len = cmdline_parse(input, &cl);
+    if (len <= 0) {
+        if (len == -1) user_printf(user, "%s\n", cl.error);
+        return 0;
+    }
+    cmd_element *cmds[SSC_MAX_STAGES];
+    for (int n = 0; n < len; n++) {
+        if ((cmds[n] = check_cmd(cl.stages[n].name)) == NULL) {
+            user_printf(user, "command not found: \"%s\" doesn't exit\n",
+                        cl.stages[n].name);
+            return 0;
+        }
+        stats_dispatch(cmds[n]->stat);
+    }
+
+    /* builtins don't need a console, they are executed in-process */
+    if (run_inproc_pipeline(user, &cl, cmds)) return 0;
+
+    int procs = 0;
+    for (int n = 0; n < len; n++) {
+        if (!is_pipe_stage(cmds[n]) && !(cmds[n]->type & SSC_CMD_INPROC)) {
+            procs++;
+        }
+    }
+    /* line_done() gives the prompt back if nothing is left running */
+    int out = exec_begin(user, procs);
+    if (out == -1) return 0;
+    exec_pipeline(user, &cl, cmds, out);
+    close(out);
+    return 0;
+}
+
+/*
+ * user_prompt() sends the prompt which the user is waiting for, it is called
+ * after every event of the user since nothing is polling the user anymore.
+ */
+void user_prompt(chatroom_user *user) {
+    if (user == NULL) return;
+    if (user->status == SSC_NONAME || user->status == SSC_NAMED) {
+        user_stat_handler(user, NULL);
     }
-    return output;
 }
 
-int group_exist_in_system(char *group) {
-    if (group == NULL) return 1;
-
-    int rtv;
-    redisReply *reply =
-        redisCommand(redisdb, "SISMEMBER Chatroom.group %s", group);
-    rtv = reply->integer;
-    freeReplyObject(reply);
-
-    return rtv;
+void line_main(void *arg) {
+    line_job *job = arg;
+    uint64_t start = stats_now();
+    user_input_handler(job->user, job->line);
+    stats_add(STAT_LINES, 1);
+    stats_record(HIST_LINE, stats_now() - start);
 }
 
-int name_exist_in_system(char *name) {
-    if (name == NULL) return 0;
-
-    int rtv;
-    redisReply *reply = redisCommand(redisdb, "SISMEMBER Chatroom %s", name);
-    rtv = reply->integer;
-    freeReplyObject(reply);
-
-    return rtv;
-    // chatroom_user *tmp = user_list;
-    // do {
-    //     if (strcmp(name, tmp->name) == 0) return 1;
-    //     tmp = tmp->next;
-    // } while (tmp != user_list);
-    // return 0;
+/*
+ * new_line_job() takes a finished job for reuse when there is one.
+ */
+line_job *new_line_job() {
+    line_job *job = job_free_list;
+    if (job) {
+        job_free_list = job->next_free;
+        job_free_len--;
+        return job;
+    }
+    if ((job = malloc(sizeof(line_job))) == NULL) return NULL;
+    job->discard = 0;
+    job->capture = -1;
+    job->arena.head = NULL;
+    return job;
 }
 
-int init_waitingcmd(waiting_cmd *w_cmd, cmd_element *cmd, chatroom_user *user,
-                    char *args) {
-    w_cmd->read = w_cmd->write = NULL;
-    w_cmd->cmd_addr = cmd;
-    if (strcmp(cmd->name, "who") == 0 || strcmp(cmd->name, "tell") == 0 ||
-        strcmp(cmd->name, "yell") == 0 || strcmp(cmd->name, "name") == 0 ||
-        strcmp(cmd->name, "listMail") == 0 ||
-        strcmp(cmd->name, "sentMail") == 0 ||
-        strcmp(cmd->name, "delMail") == 0 || strcmp(cmd->name, "Groups") == 0 ||
-        strcmp(cmd->name, "gyell") == 0 ||
-        strcmp(cmd->name, "listGroup") == 0 ||
-        strcmp(cmd->name, "createGroup") == 0 ||
-        strcmp(cmd->name, "delGroup") == 0 ||
-        strcmp(cmd->name, "addGroup") == 0 ||
-        strcmp(cmd->name, "leaveGroup") == 0 ||
-        strcmp(cmd->name, "kickUser") == 0) {
-        w_cmd->additional_data = user;
-    } else if (strcmp(cmd->name, "quit") == 0) {
-        w_cmd->additional_data = (void *)getpid();
-    }
-    if (args) {
-        w_cmd->param = strdup(args);
-    } else {
-        w_cmd->param = NULL;
+void release_line_job(line_job *job) {
+    if (job_free_len >= SSC_MAX_FREE_JOBS) {
+        arena_free(&job->arena);
+        free(job);
+        return;
     }
-    w_cmd->next = NULL;
-    return 0;
+    arena_reset(&job->arena);
+    job->next_free = job_free_list;
+    job_free_list = job;
+    job_free_len++;
 }
 
-int register_user(char *name) {
-    /* TODO: */
-    redisReply *reply;
-    reply = redisCommand(redisdb, "SADD Chatroom %s", name);
-    freeReplyObject(reply);
-    return 0;
-}
-int check_passwd(char *name, char *passwd) {
-    if (name == NULL || passwd == NULL) return -1;
+void line_done(void *arg) {
+    line_job *job = arg;
+    chatroom_user *user = job->user;
+    user->job = NULL;
+    release_line_job(job);
 
-    int rtv = 0;
-    redisReply *reply;
-    reply = redisCommand(redisdb, "GET %s", name);
-    if (reply->type == REDIS_REPLY_NIL) {
-        reply = redisCommand(redisdb, "SET %s %s", name, passwd);
-        rtv = (reply->len == 2) ? 1 : 0;
-        freeReplyObject(reply);
-        return rtv;
+    /* the line may be done before the pipeline it started, or after it */
+    if (user->status & SSC_EXECING) {
+        exec_done(user);
+    } else {
+        user_prompt(user);
     }
-    rtv = (strcmp(reply->str, passwd) == 0) ? 1 : 0;
-    freeReplyObject(reply);
-    return rtv;
-    /* TODO: if the db return nil, than set passwd as password. */
+    /* flush_users() goes on with the next line or closes the user */
+    schedule_user(user);
 }
 
-int user_stat_handler(chatroom_user *user, char *input) {
-    switch (user->status) {
-        case SSC_NONAME:
-            ssize_t size =
-                write(user->fd->write, "Who're you: ", sizeof("Who're you: "));
-            if (size == -1) {
-                perror("In server/server_start()");
-            }
-            user->status = SSC_REQNAME;
-            return SSC_NONAME;
+/*
+ * process_input() executes every complete line in user->in, it stops early
+ * when the user is busy and the remaining lines wait for the next call.
+ */
+void process_input(chatroom_user *user) {
+    size_t start = 0;
+    while (user->in_len > start && !user->closing && !user->job &&
+           !(user->status & SSC_EXECING)) {
+        char *line = user->in + start;
+        size_t left = user->in_len - start;
+        char *nl = memchr(line, '\n', left);
+
+        size_t len, used;
+        if (nl) {
+            len = nl - line;
+            used = len + 1;
+        } else if (left >= SSC_INPUT_LINE - 1) {
+            len = used = SSC_INPUT_LINE - 1;
+        } else {
             break;
-        case SSC_REQNAME:
-            if (input) {
-                char *neat_name = input_filter(input);
-                if (neat_name == NULL) {
-                    user->status = SSC_NONAME;
-                    return SSC_REQNAME;
-                }
-
-                if (!name_exist_in_system(neat_name)) {
-                    register_user(neat_name);
-                }
-                strncpy(user->name, neat_name, 1024);
-                user->status = SSC_REQPASSWD;
-                dprintf(user->fd->write, "Password: ");
+        }
+        if (len > SSC_INPUT_LINE - 1) len = SSC_INPUT_LINE - 1;
 
-                free(neat_name);
-            }
-            return SSC_REQNAME;
+        line_job *job = new_line_job();
+        coro *co = (job) ? coro_new(line_main, line_done, job) : NULL;
+        if (co == NULL) {
+            if (job) release_line_job(job);
+            disconnect_user(user);
             break;
-        case SSC_REQPASSWD:
-            if (input) {
-                char *neat_passwd = input_filter(input);
+        }
+        job->user = user;
+        memcpy(job->line, line, len);
+        job->line[len] = '\0';
+        start += used;
 
-                if (check_passwd(user->name, neat_passwd) == 1) {
-                    /* Success */
-                    dprintf(user->fd->write, "Welcome %s!\n", user->name);
-                    user->status = SSC_NAMED;
+        user->job = job;
+        coro_resume(co);
+    }
 
-                    redisReply *reply = redisCommand(
-                        redisdb, "SADD Chatroom.online %s", user->name);
-                    freeReplyObject(reply);
-                } else {
-                    dprintf(user->fd->write, "Password: ");
-                }
-                free(neat_passwd);
-            }
-            return SSC_REQPASSWD;
-            break;
-        case SSC_NAMED:
-            write(user->fd->write, user->name, strlen(user->name));
-            write(user->fd->write, "> ", sizeof(">"));
-            user->status = SSC_REQINPUT;
-            return SSC_NAMED;
-        case SSC_REQINPUT:
-            if (input) {
-                user->status = SSC_NAMED;
-            }
-            return SSC_REQINPUT;
-        default:
-            break;
+    if (start) {
+        memmove(user->in, user->in + start, user->in_len - start);
+        user->in_len -= start;
     }
-    return user->status;
+    if (user->in_len == 0) put_input_buffer(user);
 }
 
-int user_input_handler(chatroom_user *user, char *input) {
-    if (user_stat_handler(user, input) &
-        (SSC_REQNAME | SSC_EXECING | SSC_REQPASSWD))
-        return 0;
-    char *neat_input = input_filter(input);
+/*
+ * child_exit_handler() reaps the child of a pidfd which became readable,
+ * the pipeline of the user is done once its last child is gone.
+ */
+void child_exit_handler(pfd_element *pfd) {
+    chatroom_user *user = pfd->owner;
+    siginfo_t info;
+    waitid(P_PIDFD, pfd->read, &info, WEXITED | WNOHANG);
+    close_pfd(pfd);
 
-    if (neat_input == NULL) return 0;
+    if (--user->children == 0) exec_done(user);
+}
 
-    char *dup_input = strdup(neat_input);
-    char *split = cmdtok(dup_input, "|");
-    for (; split; split = cmdtok(NULL, "|")) {
-        char *name = strtok(split, " ");
-        char *param = strtok(NULL, "");
+void stats_accept_handler(pfd_element *pfd) {
+    while (1) {
+        int confd = accept4(pfd->read, NULL, NULL, SOCK_NONBLOCK);
+        if (confd == -1) break;
 
-        cmd_element *cmd_addr;
-        if ((cmd_addr = check_cmd(name)) == NULL) {
-            dprintf(user->fd->write, "command not found: \"%s\" doesn't exit\n",
-                    name);
-            free(split);
+        int fd[2] = {confd, confd};
+        pfd_element *scrape = add_pfd(fd, SSC_SOCK_SCRAPE);
+        if (scrape == NULL) {
+            close(confd);
             break;
         }
+        watch_pfd(scrape, EPOLLIN);
+    }
+}
 
-        waiting_cmd wait_cmd;
-        init_waitingcmd(&wait_cmd, cmd_addr, user, param);
+/*
+ * scrape_handler() answers whatever request with the stats, the request is
+ * read first so closing the connection doesn't reset it.
+ */
+void scrape_handler(pfd_element *pfd) {
+    char request[1024];
+    ssize_t len = read(pfd->read, request, sizeof(request));
+    if (len == -1 && (errno == EAGAIN || errno == EINTR)) return;
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = (len > 0) ? open_memstream(&body, &body_len) : NULL;
+    if (out) {
+        stats_prometheus(out);
+        if (fclose(out) == 0) {
+            char head[256];
+            int head_len =
+                snprintf(head, sizeof(head),
+                         "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\n\r\n",
+                         body_len);
+            /* a scrape is far smaller than the socket buffer */
+            send(pfd->write, head, head_len, MSG_NOSIGNAL);
+            send(pfd->write, body, body_len, MSG_NOSIGNAL);
+        }
+        free(body);
+    }
+    close_pfd(pfd);
+}
 
-        if (append_queue(wait_cmd) == -1) {
-            free_all_waiting_cmd();
-            return -1;
+void accept_handler(pfd_element *pfd, struct __ipv4_server *server) {
+    /* accept every pending connection, the listening socket is non-blocking */
+    while (1) {
+        socklen_t len = sizeof(struct sockaddr_in);
+        chatroom_user *new_user =
+            register_ipv4conn(pfd->read, server, &len, SOCK_NONBLOCK);
+        if (new_user == NULL) break;
+        user_prompt(new_user);
+    }
+}
+
+void client_handler(chatroom_user *user, uint32_t events) {
+    if (user == NULL || user->closing) return;
+    if (events & EPOLLOUT) schedule_user(user);
+    if (user->eof) {
+        /* both directions are shut, nothing can be sent anymore */
+        if (events & (EPOLLHUP | EPOLLERR)) disconnect_user(user);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+
+    if (get_input_buffer(user) == NULL) {
+        disconnect_user(user);
+        return;
+    }
+
+    int eof = 0;
+    while (user->in_len < SSC_INPUT_BUFFER) {
+        ssize_t length = read(user->fd->read, user->in + user->in_len,
+                              SSC_INPUT_BUFFER - user->in_len);
+        if (length == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            perror("read() error");
+            disconnect_user(user);
+            return;
+        }
+        if (length == 0) {
+            eof = 1;
+            break;
         }
-        free(split);
+        user->in_len += length;
+        stats_add(STAT_BYTES_IN, length);
     }
 
-    /*
-     * God, please forgive me. Here is the most ugly code in this program.
-     * START of UGLY CODE
-     */
-    waiting_cmd *first_cmd = get_n_waiting_cmd(0);
-    if (first_cmd && strcmp(first_cmd->cmd_addr->name, "name") == 0) {
-        do_name(*first_cmd->cmd_addr, first_cmd->param,
-                first_cmd->additional_data);
-        free_all_waiting_cmd();
-        free(neat_input);
-        free(dup_input);
-        return 0;
+    if (eof) {
+        /* the last line may have no newline, it's executed all the same */
+        if (user->in_len && user->in[user->in_len - 1] != '\n') {
+            user->in[user->in_len++] = '\n';
+        }
+        user->eof = 1;
     }
-    /* END of UGLY CODE */
+    process_input(user);
+    /* re-evaluate EPOLLIN, flush_users() disconnects a user done after EOF */
+    schedule_user(user);
+}
 
-    pid_t child = fork();
-    if (child == 0) {
-        /* child process */
-        if (user->fd->read) dup2(user->fd->read, STDIN_FILENO);
-        if (user->fd->write) dup2(user->fd->write, STDOUT_FILENO);
-        if (exec_all_waiting_cmd() == -1) {
-            exit(EXIT_FAILURE);
+void mailbox_handler(pfd_element *pfd) {
+    mailbox *box = &self_worker->box;
+    mailbox_ack(box);
+
+    for (mailbox_node *node; (node = mailbox_pop(box));) {
+        shard_msg *msg = (shard_msg *)node;
+        if (msg->type == SSC_MSG_FORGET) {
+            chat_store->forget(msg->to);
+        } else if (msg->type == SSC_MSG_TELL) {
+            user_write_buf(find_user(msg->to), msg->buf);
+        } else if (user_list) {
+            chatroom_user *tmp = user_list;
+            do {
+                user_write_buf(tmp, msg->buf);
+                tmp = tmp->next;
+            } while (tmp != user_list);
         }
-        while (wait(NULL) != -1)
-            ;
-        exit(EXIT_SUCCESS);
+        if (msg->buf) outbuf_unref(msg->buf);
+        free(msg);
     }
-    /* parent process */
-    free_all_waiting_cmd();
-    free(neat_input);
-    free(dup_input);
+}
 
-    user->status = SSC_EXECING;
-    user->console = child;
-    return 0;
+/*
+ * heartbeat_init() tells the store the node is alive, then again every
+ * SSC_HEARTBEAT seconds from the event loop of the first worker.
+ */
+int heartbeat_init() {
+    chat_store->heartbeat();
+
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) return -1;
+    struct itimerspec its = {.it_interval = {SSC_HEARTBEAT, 0},
+                             .it_value = {SSC_HEARTBEAT, 0}};
+    int fd[2] = {tfd, tfd};
+    pfd_element *pfd = NULL;
+    if (timerfd_settime(tfd, 0, &its, NULL) == -1 ||
+        (pfd = add_pfd(fd, SSC_TIMER)) == NULL) {
+        close(tfd);
+        return -1;
+    }
+    return watch_pfd(pfd, EPOLLIN);
+}
+
+void heartbeat_handler(pfd_element *pfd) {
+    uint64_t expired;
+    if (read(pfd->read, &expired, sizeof(expired)) > 0) {
+        chat_store->heartbeat();
+    }
 }
 
-int server_start() {
+void *worker_main(void *arg) {
+    self_worker = arg;
+    /* splice() to a broken socket raises SIGPIPE, see exec_splice() */
+    sigset_t pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+    if (chat_store->init() == -1) exit(EXIT_FAILURE);
+    if (self_worker->id == 0 && bus_subscribe(bus_deliver) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
     struct __ipv4_server server;
-    char *ip = "172.22.46.36";
-    int port = 4321;
-    int socket_fd = ipv4_config(&server, inet_addr(ip), htons(port), 1);
+    int socket_fd = ipv4_config(&server, inet_addr(SSC_SERVER_IP),
+                                htons(SSC_SERVER_PORT), 1);
     int fd[2] = {socket_fd, socket_fd};
-    add_pfd(fd, SSC_SOCK_SERV);
-    printf("server info: %s %d\n", ip, port);
+    pfd_element *serv_pfd = add_pfd(fd, SSC_SOCK_SERV);
+    EXIT_IF_FAIL(watch_pfd(serv_pfd, EPOLLIN), -1, "watch_pfd()");
+
+    if (self_worker->id == 0) {
+        struct __ipv4_server stats_server;
+        int stats_fd = ipv4_config(&stats_server, inet_addr(SSC_STATS_IP),
+                                   htons(SSC_STATS_PORT), 1);
+        int stats_fds[2] = {stats_fd, stats_fd};
+        pfd_element *stats_pfd = add_pfd(stats_fds, SSC_SOCK_STATS);
+        EXIT_IF_FAIL(watch_pfd(stats_pfd, EPOLLIN), -1, "watch_pfd()");
+    }
+
+    int box_fd[2] = {self_worker->box.efd, self_worker->box.efd};
+    pfd_element *box_pfd = add_pfd(box_fd, SSC_EVENT);
+    EXIT_IF_FAIL(watch_pfd(box_pfd, EPOLLIN), -1, "watch_pfd()");
+
+    if (self_worker->id == 0 && chat_store->heartbeat) {
+        EXIT_IF_FAIL(heartbeat_init(), -1, "heartbeat_init()");
+    }
+
+    EXIT_IF_FAIL(cmd_out_init(), -1, "cmd_out_init()");
 
+    struct epoll_event events[SSC_MAX_EVENTS];
     while (1) {
-        socklen_t len = sizeof(struct sockaddr_in);
-        chatroom_user *new_user =
-            register_ipv4conn(socket_fd, &server, &len, SOCK_NONBLOCK);
+        int nfds = wait_pfd(events, SSC_MAX_EVENTS, -1);
+        if (nfds == -1) {
+            if (errno == EINTR) continue;
+            perror("wait_pfd()");
+            break;
+        }
 
-        if (user_list == NULL) continue;
-        chatroom_user *tmp = user_list;
-        do {
-            /* read from every user socket fd */
-            char input[1024] = {0};
-            int length = read(tmp->fd->read, input, sizeof(input) - 1);
-
-            switch (length) {
-                case -1:
-                    if (errno == EAGAIN) {
-                        user_stat_handler(tmp, NULL);
-                        break;
-                    }
-                    perror("read() error");
-                    continue;
+        for (int i = 0; i < nfds; i++) {
+            pfd_element *pfd = events[i].data.ptr;
+            switch (pfd->fdtype) {
+                case SSC_SOCK_SERV:
+                    accept_handler(pfd, &server);
+                    break;
+                case SSC_PIDFD:
+                    child_exit_handler(pfd);
+                    break;
+                case SSC_EXEC_OUT:
+                    exec_output_handler(pfd);
+                    break;
+                case SSC_TIMER:
+                    heartbeat_handler(pfd);
+                    break;
+                case SSC_EVENT:
+                    mailbox_handler(pfd);
+                    break;
+                case SSC_SOCK_DB:
+                    db_handler(pfd, events[i].events);
+                    break;
+                case SSC_STORE:
+                    chat_store->handler(pfd);
+                    break;
+                case SSC_SOCK_CLIENT:
+                    client_handler(fd_to_user(pfd->read), events[i].events);
+                    break;
+                case SSC_SOCK_STATS:
+                    stats_accept_handler(pfd);
+                    break;
+                case SSC_SOCK_SCRAPE:
+                    scrape_handler(pfd);
                     break;
-                case 0:
-                    redisReply *reply = redisCommand(
-                        redisdb, "SREM Chatroom.online %s", tmp->name);
-                    freeReplyObject(reply);
-                    tmp = close_user(tmp);
-                    continue;
                 default:
-                    user_input_handler(tmp, input);
                     break;
             }
+        }
+        flush_users();
+    }
+    return NULL;
+}
 
-            if (tmp->status & SSC_EXECING) {
-                pid_t p = waitpid(tmp->console, NULL, WNOHANG);
-                if (p > 0) {
-                    tmp->status = SSC_NAMED;
-                }
-            }
-            if (tmp) tmp = tmp->next;
-        } while (tmp && tmp != user_list);
+/*
+ * server_start() runs nworkers event loops, worker 0 is the calling thread.
+ */
+int server_start(int nworkers) {
+    workers = calloc(nworkers, sizeof(worker));
+    if (workers == NULL) return -1;
+
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        EXIT_IF_FAIL(mailbox_init(&workers[i].box), -1, "mailbox_init()");
     }
-    redisFree(redisdb);
+    worker_count = nworkers;
+    printf("server info: %s %d, %d worker(s)\n", SSC_SERVER_IP,
+           SSC_SERVER_PORT, nworkers);
+
+    for (int i = 1; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+                           &workers[i]) != 0) {
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    worker_main(&workers[0]);
+    return 0;
+}
+
+int do_stats(struct __cmd_element stats, char *params, ...) {
+    stats_print(cmd_out);
     return 0;
 }
 
@@ -443,33 +1810,47 @@ int do_who(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    printf(" %-15s%-15s\n", "<name>", "<IP:port>");
-    printf(GREEN_LIGHT);
+    fprintf(cmd_out, " %-15s%-15s\n", "<name>", "<IP:port>");
+    fprintf(cmd_out, GREEN_LIGHT);
     chatroom_user *tmp = user_list;
     do {
         if (tmp == self)
-            printf("*");
+            fprintf(cmd_out, "*");
         else
-            printf(" ");
+            fprintf(cmd_out, " ");
 
         struct sockaddr_in fd_info;
         socklen_t fd_size = sizeof(fd_info);
         getsockname(tmp->fd->read, (struct sockaddr *)&fd_info, &fd_size);
-        char *addr = inet_ntoa(fd_info.sin_addr);
-        printf("%-15s%-15s:%d\n", tmp->name, addr, fd_info.sin_port);
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &fd_info.sin_addr, addr, sizeof(addr));
+        fprintf(cmd_out, "%-15s%-15s:%d\n", (tmp->name) ? tmp->name : "",
+                addr, fd_info.sin_port);
 
         tmp = tmp->next;
     } while (tmp != user_list);
 
-    printf(RESET_LIGHT);
+    /* users served by the other workers */
+    if (!in_console) {
+        pthread_rwlock_rdlock(&user_dir_lock);
+        size_t iter = 0;
+        for (hashmap_entry *e; (e = hashmap_next(&user_dir, &iter));) {
+            chatroom_user *remote = e->value;
+            if (remote->worker == self_worker->id) continue;
+            fprintf(cmd_out, " %-15sworker %-8d\n", remote->name,
+                    remote->worker);
+        }
+        pthread_rwlock_unlock(&user_dir_lock);
+    }
+
+    fprintf(cmd_out, RESET_LIGHT);
 
-    redisReply *reply;
-    reply = redisCommand(redisdb, "SDIFF Chatroom Chatroom.online");
-    for (int i = 0; i < reply->elements; i++) {
-        char *name = reply->element[i]->str;
-        printf(" %-15s%-15s:%d\n", name, "offline", -1);
+    str_list *offline = chat_store->offline_users();
+    if (offline == NULL) return -1;
+    for (size_t i = 0; i < offline->len; i++) {
+        fprintf(cmd_out, " %-15s%-15s:%d\n", offline->items[i], "offline", -1);
     }
-    freeReplyObject(reply);
+    free(offline);
     return 0;
 }
 
@@ -479,30 +1860,29 @@ int do_tell(struct __cmd_element tell, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *name = strtok(params, " ");
-    char *msg = strtok(NULL, "");
+    char *save = NULL;
+    char *name = (params) ? strtok_r(params, " ", &save) : NULL;
+    char *msg = (name) ? strtok_r(NULL, "", &save) : NULL;
     if (name == NULL) {
-        printf("who are you telling?\n");
+        fprintf(cmd_out, "who are you telling?\n");
         return 0;
     }
     if (msg == NULL) {
-        printf("what are you telling?\n");
+        fprintf(cmd_out, "what are you telling?\n");
         return 0;
     }
 
-    int foo = 1;
-    chatroom_user *tmp = user_list;
-    do {
-        if (strcmp(tmp->name, name) == 0) {
-            dprintf(tmp->fd->write, "<user:%-10s told you>: %s\n", self->name,
-                    msg);
-            foo = 0;
-            break;
-        }
-        tmp = tmp->next;
-    } while (tmp != user_list);
-
-    if (foo) printf("%s is offline, try again later\n", name);
+    out_buf *line = outbuf_printf("<user:%-10s told you>: %s\n", self->name,
+                                  msg);
+    if (line == NULL) return -1;
+    int rtv = tell_or_queue(name, line, self->name, msg, 0);
+    outbuf_unref(line);
+    if (rtv == 1) {
+        fprintf(cmd_out, "%s is offline, the message is delivered on login\n",
+                name);
+    } else if (rtv == -1) {
+        fprintf(cmd_out, "%s is offline, try again later\n", name);
+    }
     return 0;
 }
 
@@ -515,30 +1895,21 @@ int do_yell(struct __cmd_element yell, char *params, ...) {
     char *msg = params;
 
     if (msg == NULL) {
-        printf("what are you yelling?\n");
+        fprintf(cmd_out, "what are you yelling?\n");
+        return 0;
     }
 
-    chatroom_user *tmp = user_list;
-    do {
-        dprintf(tmp->fd->write, "<user:%-10s yelled>: %s\n", self->name, msg);
-        tmp = tmp->next;
-    } while (tmp != user_list);
-
+    out_buf *line = outbuf_printf("<user:%-10s yelled>: %s\n", self->name,
+                                  msg);
+    if (line == NULL) return -1;
+    broadcast(line);
+    bus_publish(SSC_BUS_YELL, NULL, line->data);
+    outbuf_unref(line);
     return 0;
 }
 
 int del_user_from_group(char *group, char *user) {
-    int rtv;
-    redisReply *gpmem, *userlist;
-
-    gpmem = redisCommand(redisdb, "ZREM %s %s", group, user);
-    rtv = gpmem->integer;
-
-    userlist = redisCommand(redisdb, "LREM %s.group 0 %s", user, group);
-
-    freeReplyObject(gpmem);
-    freeReplyObject(userlist);
-    return !(!rtv);
+    return chat_store->quit_group(group, user) == 1;
 }
 
 int do_name(struct __cmd_element name, char *params, ...) {
@@ -547,42 +1918,32 @@ int do_name(struct __cmd_element name, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *new_name = params;
-    if (name_exist_in_system(new_name)) {
-        dprintf(self->fd->write, "User name exist, Please change\n");
+    char *save = NULL;
+    char *new_name = (params) ? strtok_r(params, " ", &save) : NULL;
+    if (new_name == NULL) {
+        fprintf(cmd_out, "what is your new name?\n");
+        return 0;
+    }
+    /* see index_user_name(), the worker would keep the old name */
+    if (in_console) {
+        fprintf(cmd_out, "name can't be changed in a pipeline\n");
         return 0;
     }
 
-    register_user(new_name);
-
-    char *old_name = strdup(self->name);
-    strncpy(self->name, new_name, 1024);
-
-    redisReply *gps, *add, *del0, *del1, *del2;
-    gps = redisCommand(redisdb, "LRANGE %s.group 0 -1", old_name);
-    for (int i = 0; i < gps->elements; i++) {
-        char *gp = gps->element[i]->str;
-        redisReply *check;
-        check = redisCommand(redisdb, "ZRANGE %s 0 0", gp);
-        if (strcmp(check->element[0]->str, old_name) == 0) {
-            add_user_to_group(gp, new_name, 0);
-        } else {
-            add_user_to_group(gp, new_name, 10);
-        }
-        del_user_from_group(gp, old_name);
+    int rtv = chat_store->rename_user(self->name, new_name);
+    if (rtv == -1) return -1;
+    if (rtv == 0) {
+        fprintf(cmd_out, "User name exist, Please change\n");
+        return 0;
     }
-    add = redisCommand(redisdb, "SADD Chatroom.online %s", new_name);
-    del0 = redisCommand(redisdb, "SREM Chatroom.online %s", old_name);
-    del1 = redisCommand(redisdb, "SREM Chatroom %s", old_name);
-    del2 = redisCommand(redisdb, "DEL %s %s.group %s.mail", old_name, old_name, old_name);
 
-    freeReplyObject(add);
-    freeReplyObject(del0);
-    freeReplyObject(del1);
-    freeReplyObject(del2);
-    freeReplyObject(gps);
+    unindex_user_name(self);
+    rtv = set_user_name(self, new_name);
+    if (index_user_name(self) == -1) {
+        fprintf(cmd_out, "%s is logged in already\n", self->name);
+    }
 
-    return 0;
+    return (rtv == -1) ? -1 : 0;
 }
 
 int do_listMail(struct __cmd_element who, char *params, ...) {
@@ -591,16 +1952,36 @@ int do_listMail(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    printf("<id> <date>             <sender>        <message>\n");
-    redisReply *reply =
-        redisCommand(redisdb, "LRANGE %s.mail 0 -1", self->name);
-    for (int i = 0; i < reply->elements; i += 4) {
-        char *date = reply->element[i]->str;
-        char *time = reply->element[i + 1]->str;
-        char *author = reply->element[i + 2]->str;
-        char *msg = reply->element[i + 3]->str;
-        printf("%4d %-10s %-8s %-15s %-25s\n", i / 4, date, time, author, msg);
+    /* listMail [offset [count]] */
+    char *save = NULL;
+    char *offset_str = (params) ? strtok_r(params, " ", &save) : NULL;
+    char *count_str = (offset_str) ? strtok_r(NULL, " ", &save) : NULL;
+    long offset = (offset_str) ? strtol(offset_str, NULL, 10) : 0;
+    long count = (count_str) ? strtol(count_str, NULL, 10) : -1;
+    if (offset < 0) offset = 0;
+
+    fprintf(cmd_out, "<id> <date>             <sender>        <message>\n");
+    str_list *mails = chat_store->mails(self->name, offset, count);
+    if (mails == NULL) return -1;
+    for (size_t i = 0; i + SSC_MAIL_ITEMS <= mails->len; i += SSC_MAIL_ITEMS) {
+        char *id = mails->items[i];
+        char *date = mails->items[i + 1];
+        char *time = mails->items[i + 2];
+        char *author = mails->items[i + 3];
+        char *msg = mails->items[i + 4];
+        fprintf(cmd_out, "%4s %-10s %-8s %-15s %-25s\n", id, date, time,
+                author, msg);
+    }
+
+    if (offset_str) {
+        long total = chat_store->mail_count(self->name);
+        long shown = mails->len / SSC_MAIL_ITEMS;
+        if (total != -1) {
+            fprintf(cmd_out, "%ld-%ld of %ld mails\n", (shown) ? offset + 1 : 0,
+                    offset + shown, total);
+        }
     }
+    free(mails);
     return 0;
 }
 
@@ -610,30 +1991,23 @@ int do_sentMail(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *name = strtok(params, " ");
-    char *msg = strtok(NULL, "");
+    char *save = NULL;
+    char *name = (params) ? strtok_r(params, " ", &save) : NULL;
+    char *msg = (name) ? strtok_r(NULL, "", &save) : NULL;
     if (name == NULL) {
-        printf("who do you want to sent?\n");
+        fprintf(cmd_out, "who do you want to sent?\n");
         return 0;
     }
     if (msg == NULL) {
-        printf("what msg. do you want to sent?\n");
+        fprintf(cmd_out, "what msg. do you want to sent?\n");
         return 0;
     }
 
     if (name_exist_in_system(name)) {
-        redisReply *reply;
-        time_t t = time(NULL);
-        struct tm tm = *localtime(&t);
-        reply = redisCommand(redisdb,
-                             "rpush %s.mail %d-%02d-%02d %02d:%02d:%02d %s %s",
-                             name, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-                             tm.tm_hour, tm.tm_min, tm.tm_sec, self->name, msg);
-
-        freeReplyObject(reply);
+        chat_store->send_mail(name, self->name, msg);
     } else {
-        printf("%s%s doesn't exist in database\n%s", RED_LIGHT, name,
-               RESET_LIGHT);
+        fprintf(cmd_out, "%s%s doesn't exist in database\n%s", RED_LIGHT,
+                name, RESET_LIGHT);
     }
     return 0;
 }
@@ -644,76 +2018,86 @@ int do_delMail(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *idx_str = strtok(params, " ");
-    long int idx = strtol(idx_str, idx_str + 10, 10);
+    char *save = NULL;
+    char *id_str = (params) ? strtok_r(params, " ", &save) : NULL;
+    if (id_str == NULL) {
+        fprintf(cmd_out, "which mail do you want to delete?\n");
+        return 0;
+    }
+    long int id = strtol(id_str, NULL, 10);
 
-    redisReply *del, *rem;
-    for (int i = idx * 4; i < idx * 4 + 4; i++) {
-        del = redisCommand(redisdb, "LSET %s.mail %d /SD_DELETE_ED/",
-                           self->name, i);
-        freeReplyObject(del);
+    int rtv = chat_store->delete_mail(self->name, id);
+    if (rtv == -1) return -1;
+    if (rtv == 0) {
+        fprintf(cmd_out, "%sMail not found: %s\n%s", RED_LIGHT, id_str,
+                RESET_LIGHT);
     }
-    rem = redisCommand(redisdb, "LREM %s.mail 4 /SD_DELETE_ED/", self->name);
-    freeReplyObject(rem);
 
     return 0;
 }
 
-int add_user_to_group(char *group, char *name, int prior) {
-    int rtv;
-    redisReply *addgroup, *addlist;
-    addgroup = redisCommand(redisdb, "ZADD %s %d %s", group, prior, name);
-
-    rtv = addgroup->integer;
-    if (rtv) {
-        addlist = redisCommand(redisdb, "RPUSH %s.group %s", name, group);
-        freeReplyObject(addlist);
-    }
-    freeReplyObject(addgroup);
-
-    return rtv;
+int add_user_to_group(char *group, const char *name, int prior) {
+    return chat_store->join_group(group, name, prior) == 1;
 }
 
 int do_Groups(struct __cmd_element who, char *params, ...) {
-    printf("The groups in system: \n");
-    redisReply *reply = redisCommand(redisdb, "SMEMBERS Chatroom.group");
-    for (int i = 0; i < reply->elements; i++) {
-        printf("%d) %s\n", i, reply->element[i]->str);
+    fprintf(cmd_out, "The groups in system: \n");
+    str_list *groups = chat_store->groups();
+    if (groups == NULL) return -1;
+    for (size_t i = 0; i < groups->len; i++) {
+        fprintf(cmd_out, "%zu) %s\n", i, groups->items[i]);
     }
+    free(groups);
     return 0;
 }
 
+
 int do_gyell(struct __cmd_element who, char *params, ...) {
     va_list ap;
     va_start(ap, params);
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *gpname = strtok(params, " ");
-    char *msg = strtok(NULL, "");
+    char *save = NULL;
+    char *gpname = (params) ? strtok_r(params, " ", &save) : NULL;
+    char *msg = (gpname) ? strtok_r(NULL, "", &save) : NULL;
+    if (gpname == NULL || msg == NULL) {
+        fprintf(cmd_out, "what are you yelling to which group?\n");
+        return 0;
+    }
+
+    str_list *gpmem = chat_store->members(gpname);
+    if (gpmem == NULL) return -1;
 
-    redisReply *check;
-    check = redisCommand(redisdb, "ZRANK %s %s", gpname, self->name);
-    if (check->type == REDIS_REPLY_NIL) {
-        printf("%sShut up, you are not the member: %s\n%s", RED_LIGHT, gpname, RESET_LIGHT);
-        freeReplyObject(check);
+    int member = 0;
+    for (size_t i = 0; i < gpmem->len && !member; i++) {
+        member = strcmp(gpmem->items[i], self->name) == 0;
+    }
+    if (!member) {
+        fprintf(cmd_out, "%sShut up, you are not the member: %s\n%s",
+                RED_LIGHT, gpname, RESET_LIGHT);
+        free(gpmem);
         return -1;
     }
-    freeReplyObject(check);
-
-    redisReply *gpmem;
-    gpmem = redisCommand(redisdb, "ZRANGE %s 0 -1", gpname);
 
-    for (int i = 0; i < gpmem->elements; i++) {
-        char *mem = gpmem->element[i]->str;
-        char *args = calloc(strlen(mem) + strlen(msg) + 2, sizeof(char));
-        strcat(args, mem);
-        args[strlen(mem)] = ' ';
-        strcat(args, msg);
-        do_tell(who, args, self);
+    /* one line is shared by every member */
+    out_buf *line = outbuf_printf("<user:%-10s told you>: %s\n", self->name,
+                                  msg);
+    if (line == NULL) {
+        free(gpmem);
+        return -1;
+    }
+    int published = !in_console && bus_remote();
+    if (published) bus_publish(SSC_BUS_GROUP, gpname, line->data);
+    for (size_t i = 0; i < gpmem->len; i++) {
+        char *mem = gpmem->items[i];
+        if (tell_or_queue(mem, line, self->name, msg, published) == -1) {
+            fprintf(cmd_out, "%s is offline, try again later\n", mem);
+        }
     }
+    outbuf_unref(line);
 
-    freeReplyObject(gpmem);
+    free(gpmem);
     return 0;
 }
 
@@ -723,13 +2107,13 @@ int do_listGroup(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    redisReply *reply =
-        redisCommand(redisdb, "LRANGE %s.group 0 -1", self->name);
-    printf("Groups: \n");
-    for (int i = 0; i < reply->elements; i++) {
-        printf("%d) %s\n", i, reply->element[i]->str);
+    str_list *groups = chat_store->groups_of(self->name);
+    if (groups == NULL) return -1;
+    fprintf(cmd_out, "Groups: \n");
+    for (size_t i = 0; i < groups->len; i++) {
+        fprintf(cmd_out, "%zu) %s\n", i, groups->items[i]);
     }
-    freeReplyObject(reply);
+    free(groups);
     return 0;
 }
 
@@ -739,16 +2123,19 @@ int do_createGroup(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *gpname = strtok(params, " ");
-    if (group_exist_in_system(gpname)) {
-        printf("%sGroup name exist\n%s", RED_LIGHT, RESET_LIGHT);
+    char *save = NULL;
+    char *gpname = (params) ? strtok_r(params, " ", &save) : NULL;
+    if (gpname == NULL) {
+        fprintf(cmd_out, "which group do you want to create?\n");
+        return 0;
+    }
+    int rtv = chat_store->create_group(gpname, self->name);
+    if (rtv == -1) return -1;
+    if (rtv == 0) {
+        fprintf(cmd_out, "%sGroup name exist\n%s", RED_LIGHT, RESET_LIGHT);
         return -1;
     }
-
-    redisReply *reply = redisCommand(redisdb, "SADD Chatroom.group %s", gpname);
-    add_user_to_group(gpname, self->name, 0);
-    freeReplyObject(reply);
-    printf("Created Successfully\n");
+    fprintf(cmd_out, "Created Successfully\n");
 
     return 0;
 }
@@ -759,32 +2146,19 @@ int do_delGroup(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *gpname = strtok(params, " ");
-    if (!group_exist_in_system(gpname)) {
-        printf("%sGroup name not exist\n%s", RED_LIGHT, RESET_LIGHT);
+    char *save = NULL;
+    char *gpname = (params) ? strtok_r(params, " ", &save) : NULL;
+    if (gpname == NULL || !group_exist_in_system(gpname)) {
+        fprintf(cmd_out, "%sGroup name not exist\n%s", RED_LIGHT, RESET_LIGHT);
         return -1;
     }
 
-    redisReply *reply = redisCommand(redisdb, "ZRANGE %s 0 0", gpname);
-    if (strcmp(reply->element[0]->str, self->name) == 0) {
-        redisReply *rm, *rm2, *del, *u;
-        rm = redisCommand(redisdb, "SREM Chatroom.group %s", gpname);
-
-        u = redisCommand(redisdb, "ZRANGE %s 0 -1", gpname);
-        for (int i = 0; i < u->elements; i++) {
-            char *user = u->element[i]->str;
-            rm2 = redisCommand(redisdb, "LREM %s.group 0 %s", user, gpname);
-            freeReplyObject(rm2);
-        }
-        del = redisCommand(redisdb, "DEL %s", gpname);
-        freeReplyObject(rm);
-        freeReplyObject(del);
-        freeReplyObject(u);
-    } else {
-        printf("%sYou're not allow to delete this group\n%s", RED_LIGHT,
-               RESET_LIGHT);
+    int rtv = chat_store->delete_group(gpname, self->name);
+    if (rtv == -1) return -1;
+    if (rtv == 0) {
+        fprintf(cmd_out, "%sYou're not allow to delete this group\n%s",
+                RED_LIGHT, RESET_LIGHT);
     }
-    freeReplyObject(reply);
 
     return 0;
 }
@@ -795,16 +2169,17 @@ int do_addGroup(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *gpname = strtok(params, " ");
-    if (!group_exist_in_system(gpname)) {
-        printf("%sGroup name not exist\n%s", RED_LIGHT, RESET_LIGHT);
+    char *save = NULL;
+    char *gpname = (params) ? strtok_r(params, " ", &save) : NULL;
+    if (gpname == NULL || !group_exist_in_system(gpname)) {
+        fprintf(cmd_out, "%sGroup name not exist\n%s", RED_LIGHT, RESET_LIGHT);
         return -1;
     }
 
     if (add_user_to_group(gpname, self->name, 10)) {
-        printf("Join Successfully\n");
+        fprintf(cmd_out, "Join Successfully\n");
     } else {
-        printf("Join Failed\n");
+        fprintf(cmd_out, "Join Failed\n");
     }
 
     return 0;
@@ -816,35 +2191,41 @@ int do_leaveGroup(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *gpname = strtok(params, " ");
+    char *save = NULL;
+    char *gpname = (params) ? strtok_r(params, " ", &save) : NULL;
+    if (gpname == NULL) {
+        fprintf(cmd_out, "which group do you want to leave?\n");
+        return 0;
+    }
+
+    str_list *gpmem = chat_store->members(gpname);
+    if (gpmem == NULL) return -1;
 
-    redisReply *check;
-    check = redisCommand(redisdb, "ZRANK %s %s", gpname, self->name);
-    if (check->type == REDIS_REPLY_NIL) {
-        printf("%sYou are not in this group\n%s", RED_LIGHT, RESET_LIGHT);
+    int member = 0;
+    for (size_t i = 0; i < gpmem->len && !member; i++) {
+        member = strcmp(gpmem->items[i], self->name) == 0;
+    }
+    if (!member) {
+        fprintf(cmd_out, "%sYou are not in this group\n%s", RED_LIGHT,
+                RESET_LIGHT);
+        free(gpmem);
         return 0;
     }
 
-    redisReply *gpowner, *rmgroup, *rmlist;
-    gpowner = redisCommand(redisdb, "ZRANGE %s 0 1", gpname);
-    if (gpowner->elements < 2) {
-        printf("delete Group...\n");
+    if (gpmem->len < 2) {
+        free(gpmem);
+        fprintf(cmd_out, "delete Group...\n");
         return do_delGroup(who, gpname, self);
     }
 
-    if (gpowner->elements == 2 &&
-        strcmp(gpowner->element[0]->str, self->name) == 0) {
-        char *nxt_owner = gpowner->element[1]->str;
-        printf("Change user from %s to %s\n", self->name, nxt_owner);
-        redisReply *chg_prior;
-        chg_prior =
-            redisCommand(redisdb, "ZADD %s %d %s", gpname, 0, nxt_owner);
-        freeReplyObject(chg_prior);
+    /* the store hands the group of a leaving owner to the next member */
+    if (strcmp(gpmem->items[0], self->name) == 0) {
+        char *nxt_owner = gpmem->items[1];
+        fprintf(cmd_out, "Change user from %s to %s\n", self->name, nxt_owner);
     }
+    free(gpmem);
 
-    rmgroup = redisCommand(redisdb, "ZREM %s %s", gpname, self->name);
-    rmlist = redisCommand(redisdb, "LREM %s.group 0 %s", self->name, gpname);
-
+    chat_store->quit_group(gpname, self->name);
     return 0;
 }
 
@@ -854,75 +2235,105 @@ int do_kickUser(struct __cmd_element who, char *params, ...) {
     chatroom_user *self = va_arg(ap, chatroom_user *);
     va_end(ap);
 
-    char *gpname = strtok(params, " ");
+    char *save = NULL;
+    char *gpname = (params) ? strtok_r(params, " ", &save) : NULL;
 
-    if (!group_exist_in_system(gpname)) {
-        printf("%sGroup name not exist\n%s", RED_LIGHT, RESET_LIGHT);
+    if (gpname == NULL || !group_exist_in_system(gpname)) {
+        fprintf(cmd_out, "%sGroup name not exist\n%s", RED_LIGHT, RESET_LIGHT);
         return -1;
     }
 
-    redisReply *check;
-    check = redisCommand(redisdb, "ZRANGE %s 0 0", gpname);
-    if (strcmp(check->element[0]->str, self->name) != 0) {
-        printf("%sYou're not allow to kick others\n%s", RED_LIGHT, RESET_LIGHT);
+    str_list *gpmem = chat_store->members(gpname);
+    if (gpmem == NULL) return -1;
+    if (gpmem->len == 0 || strcmp(gpmem->items[0], self->name) != 0) {
+        fprintf(cmd_out, "%sYou're not allow to kick others\n%s", RED_LIGHT,
+                RESET_LIGHT);
+        free(gpmem);
         return -1;
     }
+    free(gpmem);
 
-    char *user = strtok(NULL, " ");
+    char *user = strtok_r(NULL, " ", &save);
     while (user) {
         if (del_user_from_group(gpname, user)) {
-            printf("Delete success: %s\n", user);
+            fprintf(cmd_out, "Delete success: %s\n", user);
         } else {
-            printf("%sUser not found: %s\n%s", RED_LIGHT, user, RESET_LIGHT);
+            fprintf(cmd_out, "%sUser not found: %s\n%s", RED_LIGHT, user,
+                    RESET_LIGHT);
         }
-        user = strtok(NULL, " ");
+        user = strtok_r(NULL, " ", &save);
     }
 
     return 0;
 }
 
+/*
+ * add_chat_command() registers a builtin which only touches the chatroom
+ * state, such builtin is executed in-process when it isn't piped.
+ */
+int add_chat_command(char *cmd_name, cmd_callback operation) {
+    if (add_builtin_command(cmd_name, NULL, operation) == -1) return -1;
+    cmd_element *cmd = check_cmd(cmd_name);
+    cmd->type |= SSC_CMD_INPROC;
+    cmd->stat = stats_command(cmd->name);
+    return 0;
+}
+
 int do_server(struct __cmd_element server, char *params, ...) {
     char *new_params = strdup(params);
     char **params_list = parse_params(new_params, 1);
-    params_list[0] = server.name;
+    params_list[0] = (char *)server.name;
 
     free_all_waiting_cmd();
-    if (add_builtin_command("who", NULL, do_who) == -1) return -1;
-    if (add_builtin_command("tell", NULL, do_tell) == -1) return -1;
-    if (add_builtin_command("yell", NULL, do_yell) == -1) return -1;
-    if (add_builtin_command("name", NULL, do_name) == -1) return -1;
-
-    if (add_builtin_command("listMail", NULL, do_listMail) == -1) return -1;
-    if (add_builtin_command("sentMail", NULL, do_sentMail) == -1) return -1;
-    if (add_builtin_command("delMail", NULL, do_delMail) == -1) return -1;
-
-    if (add_builtin_command("Groups", NULL, do_Groups) == -1) return -1;
-    if (add_builtin_command("gyell", NULL, do_gyell) == -1) return -1;
-    if (add_builtin_command("listGroup", NULL, do_listGroup) == -1) return -1;
-    if (add_builtin_command("createGroup", NULL, do_createGroup) == -1)
-        return -1;
-    if (add_builtin_command("delGroup", NULL, do_delGroup) == -1) return -1;
-    if (add_builtin_command("addGroup", NULL, do_addGroup) == -1) return -1;
-    if (add_builtin_command("leaveGroup", NULL, do_leaveGroup) == -1) return -1;
-    if (add_builtin_command("kickUser", NULL, do_kickUser) == -1) return -1;
+    if (add_chat_command("who", do_who) == -1) return -1;
+    if (add_chat_command("tell", do_tell) == -1) return -1;
+    if (add_chat_command("yell", do_yell) == -1) return -1;
+    if (add_chat_command("name", do_name) == -1) return -1;
+
+    if (add_chat_command("listMail", do_listMail) == -1) return -1;
+    if (add_chat_command("sentMail", do_sentMail) == -1) return -1;
+    if (add_chat_command("delMail", do_delMail) == -1) return -1;
+
+    if (add_chat_command("Groups", do_Groups) == -1) return -1;
+    if (add_chat_command("gyell", do_gyell) == -1) return -1;
+    if (add_chat_command("listGroup", do_listGroup) == -1) return -1;
+    if (add_chat_command("createGroup", do_createGroup) == -1) return -1;
+    if (add_chat_command("delGroup", do_delGroup) == -1) return -1;
+    if (add_chat_command("addGroup", do_addGroup) == -1) return -1;
+    if (add_chat_command("leaveGroup", do_leaveGroup) == -1) return -1;
+    if (add_chat_command("kickUser", do_kickUser) == -1) return -1;
+    if (add_chat_command("stats", do_stats) == -1) return -1;
 
     int success = 0;
-    if (strcmp(params_list[1], "start") == 0) {
-        printf("Server start\n");
-        printf("Connecting to redis server :)\n");
-
-        redisdb = redisConnect("127.0.0.1", 6379);
-        if (redisdb == NULL || redisdb->err) {
-            if (redisdb) {
-                printf("Error: %s\n", redisdb->errstr);
-            } else {
-                printf("Can't allocate redis context\n");
-            }
+    if (params_list[1] && strcmp(params_list[1], "start") == 0) {
+        int nworkers = (params_list[2]) ? atoi(params_list[2]) : 1;
+        if (nworkers < 1) nworkers = 1;
+        if (nworkers > SSC_MAX_WORKERS) nworkers = SSC_MAX_WORKERS;
+
+        /* server start [workers] [redis|memory [path]] */
+        chat_store = find_store(params_list[3]);
+        if (chat_store == NULL) {
+            printf("Store not found: %s\n", params_list[3]);
+            exit(EXIT_FAILURE);
+        }
+        if (chat_store->open && chat_store->open(params_list[4]) == -1) {
+            perror("Can't open store");
             exit(EXIT_FAILURE);
         }
+        /* other nodes can only share a redis store */
+        bus_open(chat_store == &redis_store);
 
-        printf("Redis server Connected :)\n");
-        success = server_start();
+        printf("Server start\n");
+        if (chat_store == &redis_store) {
+            printf("Connecting to redis server :)\n");
+
+            redisContext *c = db_connect();
+            if (c == NULL) exit(EXIT_FAILURE);
+            redisFree(c);
+
+            printf("Redis server Connected :)\n");
+        }
+        success = server_start(nworkers);
         exit(!(!success));
     } else {
         printf("Parameter not found\n");
@@ -936,7 +2347,7 @@ int do_server(struct __cmd_element server, char *params, ...) {
 void showall_user() {
     chatroom_user *tmp = user_list;
     do {
-        printf("%s <--> ", tmp->name);
+        printf("%s <--> ", (tmp->name) ? tmp->name : "");
         tmp = tmp->next;
     } while (tmp != user_list);
     printf("\n");
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include "spawner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/*
+ * spawn_argv() splits param on spaces into the arguments after name, param
+ * is cut in place. The list is released with free().
+ */
+static char **spawn_argv(const char *name, char *param) {
+    size_t argc = 2;
+    for (char *c = param; c && *c; c++) {
+        if (*c == ' ') argc++;
+    }
+
+    char **argv = malloc((argc + 1) * sizeof(char *));
+    if (argv == NULL) return NULL;
+
+    size_t i = 0;
+    argv[i++] = (char *)name;
+    char *save = NULL;
+    for (char *arg = (param) ? strtok_r(param, " ", &save) : NULL; arg;
+         arg = strtok_r(NULL, " ", &save)) {
+        argv[i++] = arg;
+    }
+    argv[i] = NULL;
+    return argv;
+}
+
+/*
+ * spawn_one() starts cmd reading in and writing out, in the process group
+ * pgid (a new one led by cmd when pgid is 0).
+ */
+static int spawn_one(pid_t *pid, cmd_element *cmd, char *param, int in,
+                     int out, pid_t pgid) {
+    char **argv = spawn_argv(cmd->name, param);
+    if (argv == NULL) return errno;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    if (in != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    }
+    if (out != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    }
+
+    /* the binary gets the signals as if it was started by a shell */
+    sigset_t mask, def;
+    sigemptyset(&mask);
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    sigaddset(&def, SIGCHLD);
+    sigaddset(&def, SIGINT);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETPGROUP);
+
+    int err =
+        posix_spawn(pid, cmd->fullname, &actions, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    free(argv);
+    return err;
+}
+
+int spawn_pipeline(int n, cmd_element *const *cmds, char *const *params,
+                   int fd_in, int fd_out, pid_t pgid, pid_t *pids) {
+    int started = 0;
+    int in = fd_in, err = 0;
+    for (int i = 0; i < n; i++) {
+        /* the pipes never leak into the other stages */
+        int fd[2] = {-1, -1};
+        if (i + 1 < n && pipe2(fd, O_CLOEXEC) == -1) {
+            err = errno;
+            dprintf(fd_out, "pipe: %s\n", strerror(err));
+            break;
+        }
+
+        int out = (i + 1 < n) ? fd[1] : fd_out;
+        pid_t group = (pgid || !started) ? pgid : pids[0];
+        if ((err = spawn_one(&pids[started], cmds[i], params[i], in, out,
+                             group))) {
+            dprintf(fd_out, "%s: %s\n", cmds[i]->name, strerror(err));
+        } else {
+            started++;
+        }
+
+        if (in != fd_in) close(in);
+        if (fd[1] != -1) close(fd[1]);
+        in = fd[0];
+    }
+    if (in != fd_in && in != -1) close(in);
+
+    if (started == 0) errno = (err) ? err : ENOEXEC;
+    return started;
+}
@@ -0,0 +1,23 @@
+#include <sys/types.h>
+
+#include "console.h"
+
+#ifndef SIMPLE_SERVER_SPAWNER_H
+#define SIMPLE_SERVER_SPAWNER_H
+
+/*
+ * spawn_pipeline() starts n external binaries connected by pipes with
+ * posix_spawn(), which doesn't copy the page tables of the caller however
+ * much memory it holds. The first reads fd_in, the last writes fd_out.
+ *
+ * The pids of the binaries started are put in pids, their number is
+ * returned, 0 with errno set if nothing could be started. They join the
+ * process group pgid, or a new one led by pids[0] if pgid is 0, so they
+ * can be signaled together. A failure is
+ * reported on fd_out, the rest of the pipeline goes on without the stage
+ * which can't be started.
+ */
+int spawn_pipeline(int n, cmd_element *const *cmds, char *const *params,
+                   int fd_in, int fd_out, pid_t pgid, pid_t *pids);
+
+#endif /* SIMPLE_SERVER_SPAWNER_H */
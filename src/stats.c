@@ -0,0 +1,281 @@
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HIST_COUNT (HIST_CMD + SSC_STATS_CMDS)
+#define HIST_SUB_MASK ((1u << SSC_HIST_SUB_BITS) - 1)
+
+typedef struct __stats_hist {
+    uint64_t count, sum, max;
+    uint64_t buckets[SSC_HIST_BUCKETS];
+} stats_hist;
+
+/*
+ * stats_shard is the copy of a thread. Only the owner writes it, the
+ * stores are atomic so a reader never sees a torn value.
+ */
+typedef struct __stats_shard {
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t dispatched[SSC_STATS_CMDS];
+    stats_hist hists[HIST_COUNT];
+    struct __stats_shard *next;
+} stats_shard;
+
+static const struct {
+    const char *name, *help;
+} counter_info[STAT_COUNTERS] = {
+    {"ssc_connections_accepted_total", "Connections accepted."},
+    {"ssc_connections_closed_total", "Connections closed."},
+    {"ssc_received_bytes_total", "Bytes read from users."},
+    {"ssc_sent_bytes_total", "Bytes sent to users."},
+    {"ssc_lines_total", "Input lines executed."},
+    {"ssc_consoles_total", "Consoles forked for pipelines."},
+    {"ssc_console_forks_total", "Commands forked by the consoles."},
+    {"ssc_spawned_total", "External binaries spawned without a console."},
+    {"ssc_redis_commands_total", "Redis round trips."},
+    {"ssc_redis_sent_total", "Redis commands sent without waiting."},
+};
+
+/*
+ * Commands are named before the workers start. Command 0 stands for every
+ * command without a name of its own.
+ */
+static const char *cmd_names[SSC_STATS_CMDS] = {"other"};
+static int cmd_count = 1;
+
+static stats_shard *shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread stats_shard *self_shard = NULL;
+
+static stats_shard *get_shard() {
+    if (self_shard) return self_shard;
+
+    stats_shard *shard = calloc(1, sizeof(stats_shard));
+    if (shard == NULL) return NULL;
+    pthread_mutex_lock(&shards_lock);
+    shard->next = shards;
+    shards = shard;
+    pthread_mutex_unlock(&shards_lock);
+    return self_shard = shard;
+}
+
+static inline void bump(uint64_t *c, uint64_t n) {
+    __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t load(const uint64_t *c) {
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_command() gives name a counter and a histogram of its own, it
+ * returns the id of the command (0 when every id is taken).
+ */
+int stats_command(const char *name) {
+    for (int i = 1; i < cmd_count; i++) {
+        if (strcmp(cmd_names[i], name) == 0) return i;
+    }
+    if (cmd_count == SSC_STATS_CMDS) return 0;
+    cmd_names[cmd_count] = name;
+    return cmd_count++;
+}
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_add(int counter, uint64_t n) {
+    stats_shard *shard = get_shard();
+    if (shard) bump(&shard->counters[counter], n);
+}
+
+void stats_dispatch(int cmd) {
+    stats_shard *shard = get_shard();
+    if (shard) bump(&shard->dispatched[cmd], 1);
+}
+
+static int hist_index(uint64_t ns) {
+    if (ns <= HIST_SUB_MASK) return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb > SSC_HIST_MAX_BIT) return SSC_HIST_BUCKETS - 1;
+    int shift = msb - SSC_HIST_SUB_BITS;
+    return ((shift + 1) << SSC_HIST_SUB_BITS) + ((ns >> shift) & HIST_SUB_MASK);
+}
+
+/* the highest value counted in the bucket */
+static uint64_t hist_value(int index) {
+    if (index <= HIST_SUB_MASK) return index;
+    int shift = (index >> SSC_HIST_SUB_BITS) - 1;
+    uint64_t low = (1u << SSC_HIST_SUB_BITS) | (index & HIST_SUB_MASK);
+    low <<= shift;
+    return low + (1ull << shift) - 1;
+}
+
+void stats_record(int hist, uint64_t ns) {
+    stats_shard *shard = get_shard();
+    if (shard == NULL) return;
+
+    stats_hist *h = &shard->hists[hist];
+    bump(&h->buckets[hist_index(ns)], 1);
+    bump(&h->count, 1);
+    bump(&h->sum, ns);
+    if (ns > h->max) __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * The readers add up the shards of every thread.
+ */
+static uint64_t sum_counter(int counter) {
+    uint64_t n = 0;
+    pthread_mutex_lock(&shards_lock);
+    for (stats_shard *s = shards; s; s = s->next) {
+        n += load(&s->counters[counter]);
+    }
+    pthread_mutex_unlock(&shards_lock);
+    return n;
+}
+
+static uint64_t sum_dispatched(int cmd) {
+    uint64_t n = 0;
+    pthread_mutex_lock(&shards_lock);
+    for (stats_shard *s = shards; s; s = s->next) {
+        n += load(&s->dispatched[cmd]);
+    }
+    pthread_mutex_unlock(&shards_lock);
+    return n;
+}
+
+static void sum_hist(stats_hist *to, int hist) {
+    memset(to, 0, sizeof(stats_hist));
+    pthread_mutex_lock(&shards_lock);
+    for (stats_shard *s = shards; s; s = s->next) {
+        stats_hist *h = &s->hists[hist];
+        for (int i = 0; i < SSC_HIST_BUCKETS; i++) {
+            to->buckets[i] += load(&h->buckets[i]);
+        }
+        to->count += load(&h->count);
+        to->sum += load(&h->sum);
+        uint64_t max = load(&h->max);
+        if (max > to->max) to->max = max;
+    }
+    pthread_mutex_unlock(&shards_lock);
+}
+
+static uint64_t percentile(const stats_hist *h, double p) {
+    uint64_t total = 0;
+    for (int i = 0; i < SSC_HIST_BUCKETS; i++) total += h->buckets[i];
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(p * total + 0.999999);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < SSC_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen < rank) continue;
+        uint64_t v = hist_value(i);
+        return (v < h->max) ? v : h->max;
+    }
+    return h->max;
+}
+
+static void print_hist(FILE *out, const char *name, uint64_t dispatched,
+                       const stats_hist *h) {
+    fprintf(out, "%-12s%10llu%10llu%10.1f%10.1f%10.1f%10.1f\n", name,
+            (unsigned long long)dispatched, (unsigned long long)h->count,
+            percentile(h, 0.5) / 1e3, percentile(h, 0.99) / 1e3,
+            percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+/*
+ * stats_print() is the report of the stats command.
+ */
+void stats_print(FILE *out) {
+    fprintf(out, "connections: %llu accepted, %llu closed\n",
+            (unsigned long long)sum_counter(STAT_ACCEPTED),
+            (unsigned long long)sum_counter(STAT_CLOSED));
+    fprintf(out, "bytes: %llu in, %llu out\n",
+            (unsigned long long)sum_counter(STAT_BYTES_IN),
+            (unsigned long long)sum_counter(STAT_BYTES_OUT));
+    fprintf(out, "lines: %llu, consoles: %llu, forked commands: %llu, "
+                 "spawned binaries: %llu\n",
+            (unsigned long long)sum_counter(STAT_LINES),
+            (unsigned long long)sum_counter(STAT_CONSOLES),
+            (unsigned long long)sum_counter(STAT_FORKS),
+            (unsigned long long)sum_counter(STAT_SPAWNS));
+    fprintf(out, "redis: %llu round trips, %llu sent\n",
+            (unsigned long long)sum_counter(STAT_DB_COMMANDS),
+            (unsigned long long)sum_counter(STAT_DB_SENT));
+
+    stats_hist h;
+    fprintf(out, "%-12s%10s%10s%10s%10s%10s%10s\n", "(us)", "dispatch",
+            "count", "p50", "p99", "p999", "max");
+    sum_hist(&h, HIST_LINE);
+    print_hist(out, "line", h.count, &h);
+    sum_hist(&h, HIST_DB);
+    print_hist(out, "redis", h.count, &h);
+    for (int i = 0; i < cmd_count; i++) {
+        uint64_t dispatched = sum_dispatched(i);
+        if (dispatched == 0) continue;
+        sum_hist(&h, HIST_CMD + i);
+        print_hist(out, cmd_names[i], dispatched, &h);
+    }
+}
+
+static void prom_summary(FILE *out, const char *name, const char *label,
+                         const stats_hist *h) {
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    const char *sep = (*label) ? "," : "";
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(double); i++) {
+        fprintf(out, "%s{%s%squantile=\"%g\"} %.9f\n", name, label, sep,
+                quantiles[i], percentile(h, quantiles[i]) / 1e9);
+    }
+    const char *open = (*label) ? "{" : "", *close = (*label) ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, open, label, close,
+            h->sum / 1e9);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, open, label, close,
+            (unsigned long long)h->count);
+}
+
+/*
+ * stats_prometheus() writes the stats in the Prometheus text format.
+ */
+void stats_prometheus(FILE *out) {
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                counter_info[i].name, counter_info[i].help,
+                counter_info[i].name, counter_info[i].name,
+                (unsigned long long)sum_counter(i));
+    }
+
+    fprintf(out, "# HELP ssc_commands_total Commands dispatched.\n"
+                 "# TYPE ssc_commands_total counter\n");
+    for (int i = 0; i < cmd_count; i++) {
+        fprintf(out, "ssc_commands_total{command=\"%s\"} %llu\n",
+                cmd_names[i], (unsigned long long)sum_dispatched(i));
+    }
+
+    stats_hist h;
+    fprintf(out, "# HELP ssc_line_seconds Time to execute an input line.\n"
+                 "# TYPE ssc_line_seconds summary\n");
+    sum_hist(&h, HIST_LINE);
+    prom_summary(out, "ssc_line_seconds", "", &h);
+
+    fprintf(out, "# HELP ssc_redis_seconds Time of a redis round trip.\n"
+                 "# TYPE ssc_redis_seconds summary\n");
+    sum_hist(&h, HIST_DB);
+    prom_summary(out, "ssc_redis_seconds", "", &h);
+
+    fprintf(out, "# HELP ssc_command_seconds Time of an in-process command.\n"
+                 "# TYPE ssc_command_seconds summary\n");
+    for (int i = 0; i < cmd_count; i++) {
+        char label[128];
+        snprintf(label, sizeof(label), "command=\"%s\"", cmd_names[i]);
+        sum_hist(&h, HIST_CMD + i);
+        prom_summary(out, "ssc_command_seconds", label, &h);
+    }
+}
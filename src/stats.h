@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef SIMPLE_SERVER_STATS_H
+#define SIMPLE_SERVER_STATS_H
+
+/*
+ * Counters and latency histograms of the server. Every thread updates its
+ * own copy without locks or atomic read-modify-write, a reader adds up the
+ * copies of all threads. What a forked console does isn't counted.
+ *
+ * A histogram keeps nanoseconds in log-linear buckets: SSC_HIST_SUB_BITS
+ * bits below the leading one are kept, so a percentile is off by less than
+ * 1/2^SSC_HIST_SUB_BITS, whatever the magnitude (as HdrHistogram does).
+ */
+#ifndef SSC_HIST_SUB_BITS
+#define SSC_HIST_SUB_BITS 4
+#endif
+#define SSC_HIST_MAX_BIT 39 /* about 9 minutes, longer is counted there */
+#define SSC_HIST_BUCKETS \
+    ((SSC_HIST_MAX_BIT - SSC_HIST_SUB_BITS + 2) << SSC_HIST_SUB_BITS)
+
+/* a command has its own counter and histogram once stats_command() named it */
+#ifndef SSC_STATS_CMDS
+#define SSC_STATS_CMDS 32
+#endif
+
+enum {
+    STAT_ACCEPTED,    /* connections accepted */
+    STAT_CLOSED,      /* connections closed */
+    STAT_BYTES_IN,    /* bytes read from users */
+    STAT_BYTES_OUT,   /* bytes sent to users through their out_queue */
+    STAT_LINES,       /* input lines executed */
+    STAT_CONSOLES,    /* consoles forked for pipelines */
+    STAT_FORKS,       /* commands forked by the consoles */
+    STAT_SPAWNS,      /* external binaries spawned without a console */
+    STAT_DB_COMMANDS, /* redis round trips */
+    STAT_DB_SENT,     /* redis commands nobody waits for */
+    STAT_COUNTERS,
+};
+
+enum {
+    HIST_LINE, /* an input line, from start to prompt */
+    HIST_DB,   /* a redis round trip */
+    HIST_CMD,  /* a command executed in-process, HIST_CMD + its id */
+};
+
+int stats_command(const char *name);
+uint64_t stats_now();
+void stats_add(int counter, uint64_t n);
+void stats_dispatch(int cmd);
+void stats_record(int hist, uint64_t ns);
+
+void stats_print(FILE *out);
+void stats_prometheus(FILE *out);
+
+#endif /* SIMPLE_SERVER_STATS_H */
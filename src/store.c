@@ -0,0 +1,41 @@
+#include "store.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+str_list *str_list_new(size_t len, const char *const *items) {
+    size_t size = sizeof(str_list) + len * sizeof(char *);
+    for (size_t i = 0; i < len; i++) size += strlen(items[i]) + 1;
+
+    str_list *list = malloc(size);
+    if (list == NULL) return NULL;
+
+    list->len = len;
+    char *str = (char *)(list->items + len);
+    for (size_t i = 0; i < len; i++) {
+        size_t n = strlen(items[i]) + 1;
+        list->items[i] = memcpy(str, items[i], n);
+        str += n;
+    }
+    return list;
+}
+
+const store *find_store(const char *name) {
+    if (name == NULL || strcmp(name, redis_store.name) == 0)
+        return &redis_store;
+    if (strcmp(name, memory_store.name) == 0) return &memory_store;
+    return NULL;
+}
+
+/*
+ * mail_stamp() writes the local date and time a mail is sent at.
+ */
+int mail_stamp(char *date, size_t date_len, char *time_str, size_t time_len) {
+    time_t t = time(NULL);
+    struct tm tm;
+    if (localtime_r(&t, &tm) == NULL) return -1;
+    strftime(date, date_len, "%Y-%m-%d", &tm);
+    strftime(time_str, time_len, "%H:%M:%S", &tm);
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <stddef.h>
+
+#ifndef SIMPLE_SERVER_STORE_H
+#define SIMPLE_SERVER_STORE_H
+
+struct __pfd_element;
+
+/*
+ * str_list is a list of strings allocated as a single block, release it
+ * with free().
+ */
+typedef struct __str_list {
+    size_t len;
+    char *items[];
+} str_list;
+
+str_list *str_list_new(size_t len, const char *const *items);
+
+/*
+ * A mail is 5 items of the list returned by store.mails: id, date, time,
+ * sender and message. Ids of a mailbox only grow, so a mail keeps its id
+ * until it's deleted and the mailbox is listed in the order of the ids.
+ */
+#define SSC_MAIL_ITEMS 5
+
+/*
+ * A message told to an offline user is queued until the user logs in, it's
+ * 3 items of the list returned by store.take_msgs: time (seconds since the
+ * epoch), sender and message. A queue keeps the last SSC_PENDING_MAX
+ * messages, and a message older than SSC_PENDING_TTL seconds is dropped.
+ */
+#define SSC_PENDING_ITEMS 3
+#ifndef SSC_PENDING_MAX
+#define SSC_PENDING_MAX 100
+#endif
+#ifndef SSC_PENDING_TTL
+#define SSC_PENDING_TTL (7 * 24 * 60 * 60)
+#endif
+
+/*
+ * The logged-in users of a node are only trusted while the node is alive,
+ * store.heartbeat is called by its first worker every SSC_HEARTBEAT
+ * seconds. A node missing SSC_HEARTBEAT_LOST heartbeats is gone.
+ */
+#ifndef SSC_HEARTBEAT
+#define SSC_HEARTBEAT 10
+#endif
+#define SSC_HEARTBEAT_LOST 3
+
+/*
+ * store is where the chatroom keeps its users, passwords, groups and mail.
+ * A group is an ordered set of members, a lower prior ranks first and the
+ * first member owns the group.
+ *
+ * Lists are returned to the caller, NULL means the store failed. Functions
+ * returning int return -1 on failure. The redis store may suspend the
+ * calling job (see db.h). The memory store suspends a job which changed it
+ * until the change is on disk, if the store is kept on disk.
+ *
+ * open(arg) is called once before the workers start, arg is the rest of
+ * "server start" (may be NULL). init() is called by every worker before it
+ * serves anybody.
+ */
+typedef struct __store {
+    const char *name;
+    int (*open)(const char *arg);
+    int (*init)();
+
+    int (*user_exists)(const char *name);
+    int (*add_user)(const char *name);
+    /* 1 if passwd matches, a user without password takes passwd */
+    int (*check_passwd)(const char *name, const char *passwd);
+    /* name is logged in on this node, or it isn't anymore */
+    void (*set_online)(const char *name, int online);
+    /* 1 if name is logged in on a node which is alive */
+    int (*is_online)(const char *name);
+    /* NULL if the store has no other node to tell */
+    void (*heartbeat)();
+    str_list *(*offline_users)();
+    /* 0 if new_name is taken, the groups of the user follow the name */
+    int (*rename_user)(const char *old_name, const char *new_name);
+
+    int (*group_exists)(const char *group);
+    str_list *(*groups)();
+    str_list *(*groups_of)(const char *name);
+    str_list *(*members)(const char *group);
+    /* 0 if the group exists already */
+    int (*create_group)(const char *group, const char *owner);
+    /* 0 unless owner owns the group */
+    int (*delete_group)(const char *group, const char *owner);
+    /* 0 if name is a member already, its prior is updated */
+    int (*join_group)(const char *group, const char *name, int prior);
+    /* 0 if name isn't a member, the group of a leaving owner goes to the
+     * next member */
+    int (*quit_group)(const char *group, const char *name);
+
+    /* count mails from the offset-th on, all of them if count < 0 */
+    str_list *(*mails)(const char *name, long offset, long count);
+    long (*mail_count)(const char *name);
+    int (*send_mail)(const char *to, const char *from, const char *msg);
+    /* 0 if there is no mail with this id */
+    int (*delete_mail)(const char *name, long id);
+
+    int (*queue_msg)(const char *name, const char *from, const char *msg);
+    /* the messages queued for name, the queue is emptied */
+    str_list *(*take_msgs)(const char *name);
+
+    /* drops what the worker caches of the key another worker, or node,
+     * wrote (NULL if the store caches nothing) */
+    void (*forget)(const char *key);
+    /* handles an SSC_STORE pfd made by init() (NULL if the store makes
+     * none) */
+    void (*handler)(struct __pfd_element *pfd);
+} store;
+
+extern const store redis_store;
+extern const store memory_store;
+
+const store *find_store(const char *name);
+int mail_stamp(char *date, size_t date_len, char *time_str, size_t time_len);
+
+#endif /* SIMPLE_SERVER_STORE_H */
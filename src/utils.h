@@ -1,3 +1,6 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 
 #ifndef SIMPLE_SERVER_UTILs_H
@@ -16,6 +19,19 @@ static inline void exit_if_fail(int val, int fail, char *msg){
     }
 }
 
+/*
+ * str_hash() is 32-bit FNV-1a, it's used as the hash of every string keyed
+ * table in the server.
+ */
+static inline uint32_t str_hash(const char *str) {
+    uint32_t hash = 2166136261u;
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 char **parse_params(char *params, int at);
 
 #define RED_LIGHT "\033[0;31m"
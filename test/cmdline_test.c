@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cmdline.h"
+
+/*
+ * cmdline_test checks cmdline_parse() on the lines of the table, a stage is
+ * written "name" or "name(param)" and the stages are joined by spaces.
+ *
+ *   make test
+ */
+typedef struct __cmdline_case {
+    const char *line;
+    const char *stages;
+} cmdline_case;
+
+static const cmdline_case cases[] = {
+    {"who", "who"},
+    {"  tell   bob   hi there  ", "tell(bob   hi there)"},
+    {"ls|grep x", "ls | grep(x)"},
+    {"ls | grep x |", "ls | grep(x) |"},
+    {"\"tell bob\" hi", "tell bob(hi)"},
+    {"tell bob \"hi | there\"", "tell(bob hi | there)"},
+    {"tell bob hi 'x y'|yell z", "tell(bob hi x y) | yell(z)"},
+    {"tell bob it's fine", "tell(bob it's fine)"},
+    {"tell bob a\"b c\"", "tell(bob a\"b c\")"},
+    {"tell bob \"unmatched | x", "tell(bob \"unmatched) | x"},
+    {"yell hi\tthere", "yell(hi)"},
+};
+
+static void format(const cmd_line *cl, char *out, size_t len) {
+    size_t n = 0;
+    out[0] = '\0';
+    for (int i = 0; i < cl->len && n < len; i++) {
+        const cmd_stage *s = &cl->stages[i];
+        n += snprintf(out + n, len - n, (s->param) ? "%s%s(%s)" : "%s%s",
+                      (i) ? " " : "", s->name, s->param);
+    }
+}
+
+int main() {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char line[256], got[512];
+        cmd_line cl;
+        snprintf(line, sizeof(line), "%s", cases[i].line);
+        if (cmdline_parse(line, &cl) == -1) {
+            snprintf(got, sizeof(got), "error: %s", cl.error);
+        } else {
+            format(&cl, got, sizeof(got));
+        }
+        if (strcmp(got, cases[i].stages) != 0) {
+            printf("FAIL %s\n  want %s\n  got  %s\n", cases[i].line,
+                   cases[i].stages, got);
+            failed++;
+        }
+    }
+    printf("%zu cases, %d failed\n", sizeof(cases) / sizeof(cases[0]),
+           failed);
+    return (failed) ? 1 : 0;
+}